@@ -61,6 +61,11 @@ public:
   virtual uint8_t GetTransmitErrorCounter() const = 0;
   virtual uint8_t GetReceiveErrorCounter() const = 0;
 
+  // number of messages waiting in the transmit queue, used to detect a congested bus
+  virtual uint32_t GetTransmitQueueCount() { return 0; };
+  // wait till less than level messages are in the transmit queue, returns false after the timeout
+  virtual bool WaitTransmitQueue(uint32_t level, CTL_TIME_t msTimeout) { return true; };
+
   // a ms delay, uses FreeRTOS
   void Delay(CTL_TIME_t msDelay) const;
 
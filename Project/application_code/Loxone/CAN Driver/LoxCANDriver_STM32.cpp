@@ -7,6 +7,7 @@
 
 #include "LoxCANDriver_STM32.hpp"
 #include "LoxExtension.hpp"
+#include "Monitor.hpp"
 #include "stm32f1xx_hal_conf.h"
 #include "system.hpp"
 #include <__cross_studio_io.h>
@@ -72,6 +73,7 @@ void LoxCANDriver_STM32::vCANTXTask(void *pvParameters) {
         if (status != HAL_OK)
           break;
         ctl_fifo_remove(&_this->transmitFifo);
+        ctl_events_set_clear(&_this->transmitEvent, eMainEvents_CanSent, 0); // wake up WaitTransmitQueue()
         unsigned tq = ctl_fifo_num_used(&_this->transmitFifo);
         _this->statistics.TQ = tq;
         if (tq > _this->statistics.mTQ)
@@ -92,17 +94,15 @@ void LoxCANDriver_STM32::Startup(void) {
   ctl_fifo_init(&transmitFifo, transmitBuffer, sizeof(transmitBuffer[0]), sizeof(transmitBuffer) / sizeof(transmitBuffer[0]), &transmitEvent, eMainEvents_CanMessaged);
   ctl_fifo_init(&receiveFifo, receiveBuffer, sizeof(receiveBuffer[0]), sizeof(receiveBuffer) / sizeof(receiveBuffer[0]), &gMainEvent, eMainEvents_CanMessaged);
 
-#define RX_STACKSIZE 256
-  static unsigned sCANTXTaskStack[1 + RX_STACKSIZE + 1];
+#define TX_STACKSIZE 256
+  static unsigned sCANTXTaskStack[1 + TX_STACKSIZE + 1];
   static CTL_TASK_t sCANTXTask;
-  sCANTXTaskStack[0] = sCANTXTaskStack[1 + RX_STACKSIZE] = 0xfacefeed; // put marker values at the words before/after the stack
-  ctl_task_run(&sCANTXTask, 0x20, LoxCANDriver_STM32::vCANTXTask, this, "CAN_TX", RX_STACKSIZE, sCANTXTaskStack + 1, 0);
+  monitor_task_run(&sCANTXTask, 0x20, LoxCANDriver_STM32::vCANTXTask, this, "CAN_TX", TX_STACKSIZE, sCANTXTaskStack);
 
-#define TX_STACKSIZE 256
-  static unsigned sCANRXTaskStack[1 + TX_STACKSIZE + 1];
-  sCANRXTaskStack[0] = sCANRXTaskStack[1 + TX_STACKSIZE] = 0xfacefeed; // put marker values at the words before/after the stack
+#define RX_STACKSIZE 256
+  static unsigned sCANRXTaskStack[1 + RX_STACKSIZE + 1];
   static CTL_TASK_t sCANRXTask;
-  ctl_task_run(&sCANRXTask, 0x10, LoxCANDriver_STM32::vCANRXTask, this, "CAN_RX", TX_STACKSIZE, sCANRXTaskStack + 1, 0);
+  monitor_task_run(&sCANRXTask, 0x10, LoxCANDriver_STM32::vCANRXTask, this, "CAN_RX", RX_STACKSIZE, sCANRXTaskStack);
 
   gCan.Instance = CAN1;
   gCan.Init.TimeTriggeredMode = DISABLE;
@@ -198,6 +198,22 @@ uint8_t LoxCANDriver_STM32::GetReceiveErrorCounter() const {
   return gCan.Instance->ESR >> 24; // Receive error counter
 }
 
+uint32_t LoxCANDriver_STM32::GetTransmitQueueCount() {
+  return ctl_fifo_num_used(&this->transmitFifo);
+}
+
+/***
+ *  Block the calling task till the CAN TX task has drained the transmit queue below level
+ ***/
+bool LoxCANDriver_STM32::WaitTransmitQueue(uint32_t level, CTL_TIME_t msTimeout) {
+  CTL_TIME_t timeout = ctl_get_current_time() + msTimeout;
+  while (ctl_fifo_num_used(&this->transmitFifo) >= level) {
+    if (!ctl_events_wait(CTL_EVENT_WAIT_ANY_EVENTS_WITH_AUTO_CLEAR, &this->transmitEvent, eMainEvents_CanSent, CTL_TIMEOUT_ABSOLUTE, timeout))
+      return false;
+  }
+  return true;
+}
+
 /***
  *  Send a message by putting it into the transmission queue
  ***/
@@ -308,26 +324,34 @@ extern "C" void HAL_CAN_MspDeInit(CAN_HandleTypeDef *hcan) {
 * @brief This function handles USB high priority or CAN TX interrupts.
 */
 extern "C" void CAN1_TX_IRQHandler(void) {
+  MONITOR_ISR_ENTER();
   HAL_CAN_IRQHandler(&gCan);
+  MONITOR_ISR_LEAVE(eMonitorISR_CAN);
 }
 
 /**
 * @brief This function handles USB low priority or CAN RX0 interrupts.
 */
 extern "C" void CAN1_RX0_IRQHandler(void) {
+  MONITOR_ISR_ENTER();
   HAL_CAN_IRQHandler(&gCan);
+  MONITOR_ISR_LEAVE(eMonitorISR_CAN);
 }
 
 /**
 * @brief This function handles CAN RX1 interrupt.
 */
 extern "C" void CAN1_RX1_IRQHandler(void) {
+  MONITOR_ISR_ENTER();
   HAL_CAN_IRQHandler(&gCan);
+  MONITOR_ISR_LEAVE(eMonitorISR_CAN);
 }
 
 /**
 * @brief This function handles CAN SCE interrupt.
 */
 extern "C" void CAN1_SCE_IRQHandler(void) {
+  MONITOR_ISR_ENTER();
   HAL_CAN_IRQHandler(&gCan);
+  MONITOR_ISR_LEAVE(eMonitorISR_CAN);
 }
\ No newline at end of file
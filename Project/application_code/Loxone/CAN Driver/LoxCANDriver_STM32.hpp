@@ -39,6 +39,8 @@ public:
   uint32_t GetErrorCounter() const;
   uint8_t GetTransmitErrorCounter() const;
   uint8_t GetReceiveErrorCounter() const;
+  uint32_t GetTransmitQueueCount();
+  bool WaitTransmitQueue(uint32_t level, CTL_TIME_t msTimeout);
 
   // send a message onto the CAN bus
   void SendMessage(LoxCanMessage &message);
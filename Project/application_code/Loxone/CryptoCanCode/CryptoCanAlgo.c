@@ -3,7 +3,14 @@
 #include "hash.h"
 #include <string.h>
 
-void CryptoCanAlgo_DecryptInitPacket(uint8_t *data, uint32_t serial)
+static void CryptoCanAlgo_InitKey(tCryptoCanAlgoKey *key, const uint32_t *aesKey, const uint32_t *aesIV)
+{
+    AES_init_ctx(&key->ctx, (const uint8_t*)aesKey);
+    memcpy(key->iv, aesIV, AES_BLOCKLEN);
+}
+
+// The key for the init packets only depends on the serial, so it is expanded once
+void CryptoCanAlgo_InitPacketKey(tCryptoCanAlgoKey *key, uint32_t serial)
 {
     uint32_t aesKey[4];
     uint32_t aesIV[4];
@@ -11,12 +18,10 @@ void CryptoCanAlgo_DecryptInitPacket(uint8_t *data, uint32_t serial)
         aesKey[i] = ~serial ^ CryptoCanAlgoKey[i];
         aesIV[i] = serial ^ CryptoCanAlgoIV[i];
     }
-    struct AES_ctx ctx;
-    AES_init_ctx_iv(&ctx, (uint8_t*)aesKey, (uint8_t*)aesIV);
-    AES_CBC_decrypt_buffer(&ctx, data, 16);
+    CryptoCanAlgo_InitKey(key, aesKey, aesIV);
 }
 
-void CryptoCanAlgo_DecryptInitPacketLegacy(uint8_t *data, uint32_t size, uint32_t serial)
+void CryptoCanAlgo_InitPacketKeyLegacy(tCryptoCanAlgoKey *key, uint32_t serial)
 {
     uint32_t aesKey[4];
     uint32_t aesIV[4];
@@ -24,63 +29,61 @@ void CryptoCanAlgo_DecryptInitPacketLegacy(uint8_t *data, uint32_t size, uint32_
         aesKey[i] = ~serial ^ CryptoCanAlgoLegacyKey[i];
         aesIV[i] = serial ^ CryptoCanAlgoLegacyIV[i];
     }
-    struct AES_ctx ctx;
-    AES_init_ctx_iv(&ctx, (uint8_t*)aesKey, (uint8_t*)aesIV);
-    AES_CBC_decrypt_buffer(&ctx, data, size);
+    CryptoCanAlgo_InitKey(key, aesKey, aesIV);
 }
 
-void CryptoCanAlgo_EncryptInitPacketLegacy(uint8_t *data, uint32_t size, uint32_t serial)
+void CryptoCanAlgo_DecryptInitPacket(uint8_t *data, tCryptoCanAlgoKey *key)
 {
-    uint32_t aesKey[4];
-    uint32_t aesIV[4];
-    for(int i=0; i<4; ++i) {
-        aesKey[i] = ~serial ^ CryptoCanAlgoLegacyKey[i];
-        aesIV[i] = serial ^ CryptoCanAlgoLegacyIV[i];
-    }
-    struct AES_ctx ctx;
-    AES_init_ctx_iv(&ctx, (uint8_t*)aesKey, (uint8_t*)aesIV);
-    AES_CBC_encrypt_buffer(&ctx, data, size);
+    AES_ctx_set_iv(&key->ctx, key->iv);
+    AES_CBC_decrypt_buffer(&key->ctx, data, 16);
 }
 
-void CryptoCanAlgo_DecryptDataPacket(uint8_t *data, uint32_t *key, uint32_t iv)
+void CryptoCanAlgo_DecryptInitPacketLegacy(uint8_t *data, uint32_t size, tCryptoCanAlgoKey *key)
 {
-    uint32_t aesKey[4];
-    uint32_t aesIV[4];
-    for(int i=0; i<4; ++i) {
-        aesKey[i] = iv ^ key[i];
-        aesIV[i] = iv;
-    }
-    struct AES_ctx ctx;
-    AES_init_ctx_iv(&ctx, (uint8_t*)aesKey, (uint8_t*)aesIV);
-    AES_CBC_decrypt_buffer(&ctx, data, 16);
+    AES_ctx_set_iv(&key->ctx, key->iv);
+    AES_CBC_decrypt_buffer(&key->ctx, data, size);
 }
 
-void CryptoCanAlgo_EncryptDataPacket(uint8_t *data, uint32_t *key, uint32_t iv)
+void CryptoCanAlgo_EncryptInitPacketLegacy(uint8_t *data, uint32_t size, tCryptoCanAlgoKey *key)
 {
-    uint32_t aesKey[4];
-    uint32_t aesIV[4];
-    for(int i=0; i<4; ++i) {
-        aesKey[i] = iv ^ key[i];
-        aesIV[i] = iv;
-    }
-    struct AES_ctx ctx;
-    AES_init_ctx_iv(&ctx, (uint8_t*)aesKey, (uint8_t*)aesIV);
-    AES_CBC_encrypt_buffer(&ctx, data, 16);
+    AES_ctx_set_iv(&key->ctx, key->iv);
+    AES_CBC_encrypt_buffer(&key->ctx, data, size);
+}
+
+void CryptoCanAlgo_DecryptDataPacket(uint8_t *data, tCryptoCanAlgoKey *key)
+{
+    AES_ctx_set_iv(&key->ctx, key->iv);
+    AES_CBC_decrypt_buffer(&key->ctx, data, 16);
 }
 
-void CryptoCanAlgo_SolveChallenge(uint32_t random, uint32_t serial, const uint8_t *deviceID, uint32_t *aesKey, uint32_t *aesIV)
+void CryptoCanAlgo_EncryptDataPacket(uint8_t *data, tCryptoCanAlgoKey *key)
+{
+    AES_ctx_set_iv(&key->ctx, key->iv);
+    AES_CBC_encrypt_buffer(&key->ctx, data, 16);
+}
+
+// The session key of the data packets is derived from the challenge and expanded once
+void CryptoCanAlgo_SolveChallenge(uint32_t random, uint32_t serial, const uint8_t *deviceID, tCryptoCanAlgoKey *key)
 {
     uint8_t buffer[20];
     memcpy(buffer, deviceID, 12);
     memcpy(buffer + 12, &random, sizeof(random));
     memcpy(buffer + 16, &serial, sizeof(serial));
-    aesKey[0] = RSHash(buffer,sizeof(buffer));
-    aesKey[1] = JSHash(buffer,sizeof(buffer));
-    aesKey[2] = DJBHash(buffer,sizeof(buffer));
-    aesKey[3] = DEKHash(buffer,sizeof(buffer));
+    uint32_t hashKey[4];
+    hashKey[0] = RSHash(buffer,sizeof(buffer));
+    hashKey[1] = JSHash(buffer,sizeof(buffer));
+    hashKey[2] = DJBHash(buffer,sizeof(buffer));
+    hashKey[3] = DEKHash(buffer,sizeof(buffer));
     for(int i=0; i<sizeof(buffer); ++i)
         buffer[i] ^= 0xa5;
-    aesIV[0] = RSHash(buffer,sizeof(buffer));
+    uint32_t iv = RSHash(buffer,sizeof(buffer));
+    uint32_t aesKey[4];
+    uint32_t aesIV[4];
+    for(int i=0; i<4; ++i) {
+        aesKey[i] = iv ^ hashKey[i];
+        aesIV[i] = iv;
+    }
+    CryptoCanAlgo_InitKey(key, aesKey, aesIV);
 }
 
 void CryptoCanAlgo_SolveChallengeLegacy(uint32_t random, uint32_t serial, const uint8_t *deviceID, uint32_t *aesKey, uint32_t *aesIV)
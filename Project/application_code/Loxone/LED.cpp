@@ -8,6 +8,7 @@
 #include "LED.hpp"
 #include "stm32f1xx_hal_gpio.h"
 #include "stm32f1xx_hal_rcc.h"
+#include "Monitor.hpp"
 #include <ctl_api.h>
 #include <stdio.h>
 #include <string.h>
@@ -111,7 +112,7 @@ void LED::Startup(void) {
   #define STACKSIZE 128          
   static unsigned stack[1+STACKSIZE+1];
   static CTL_TASK_t led_task;
-  ctl_task_run(&led_task, 2, LED::vLEDTask, this, "LED", STACKSIZE, stack+1, 0);
+  monitor_task_run(&led_task, 2, LED::vLEDTask, this, "LED", STACKSIZE, stack);
 }
 
 void LED::off(void) {
@@ -6,8 +6,64 @@
 //
 
 #include "LoxLegacyDMXExtension.hpp"
+#if EXTENSION_DMX
+#include "Monitor.hpp"
+#include "stm32f1xx_hal.h"
 #include <__cross_studio_io.h>
 #include <stdlib.h>
+#include <string.h>
+
+// USART2 drives the DMX line, the break is generated by switching TX into a GPIO
+#define DMX_TX_Pin GPIO_PIN_2
+#define DMX_TX_GPIO_Port GPIOA
+#define DMX_TX_ENABLE_Pin GPIO_PIN_1
+#define DMX_TX_ENABLE_GPIO_Port GPIOA
+#define DMX_TX_CRL_SHIFT (2 * 4) // PA2 configuration bits in GPIOA->CRL
+#define DMX_TX_CRL_GPIO 0x3      // output push-pull, 50MHz
+#define DMX_TX_CRL_AF 0xB        // alternate function push-pull, 50MHz
+#define DMX_RX_Pin GPIO_PIN_3
+#define DMX_RX_GPIO_Port GPIOA
+#define DMX_BAUDRATE 250000
+#define DMX_RDM_BURST 16          // max. RDM transactions between two DMX frames
+#define DMX_RDM_REPLY_US 2800     // a reply has to start within this time
+#define DMX_RDM_REPLY_END_US 250  // the line is idle this long after the last byte of a reply
+#define DMX_RDM_GAP_US 200        // between a reply and the next packet, >= 176us
+#define DMX_RDM_TIMEOUT_MS 100    // a transaction didn't finish, the line is not working
+#define DMX_RDM_ADDRESS_QUEUE_SIZE (8 * sizeof(DMX_RDM_Address))
+
+typedef enum {
+  eDMXState_break, // TX is low, TIM5 runs for the break
+  eDMXState_mab,   // TX is high, TIM5 runs for the mark after break
+  eDMXState_data,  // DMA transfers the frame, USART2 TC ends it
+  eDMXState_rdmReply, // the driver is off, DMA receives the RDM reply, TIM5 ends it
+  eDMXState_rdmGap,   // TIM5 runs for the time between an RDM reply and the next packet
+} eDMXState;
+
+static UART_HandleTypeDef huart2;
+// double buffered frame: the start code followed by the slots. The DMA sends gDMXFrame[gDMXFront],
+// updates go into the other buffer, which becomes the front at the start of the next frame.
+static uint8_t gDMXFrame[2][1 + DMX_SLOTS];
+static volatile uint8_t gDMXFront;
+static volatile bool gDMXSwap; // the back buffer is complete, swap at the next break
+static volatile eDMXState gDMXState;
+static volatile bool gDMXSendingRDM; // the current packet is gRDMPacket
+static CTL_EVENT_SET_t gDMXEvent;
+static uint8_t gDMXGamma[256]; // perception correction: the value is squared
+// RDM transaction, which is sent by the interrupts between two DMX frames
+static uint8_t gRDMPacket[RDM_PACKET_MAX];
+static int gRDMPacketSize;
+static bool gRDMExpectReply;
+static volatile bool gRDMPending; // gRDMPacket is waiting to be sent
+static int gRDMBurst;             // RDM transactions since the last DMX frame
+static uint8_t gRDMReply[RDM_REPLY_MAX];
+static volatile int gRDMReplySize;
+
+enum {
+  eDMXEvent_frameStarted = 0x01, // the back buffer is free to render the next frame
+  eDMXEvent_rdmDone = 0x02,      // the RDM transaction is finished, gRDMReply is valid
+  eDMXEvent_rdmSearch = 0x04,    // the Miniserver asked for a device search
+  eDMXEvent_rdmAddress = 0x08,   // a start address was queued
+};
 
 typedef struct {
   uint8_t Type;
@@ -35,11 +91,440 @@ typedef struct {
   uint32_t DeviceId;
 } DMX_Init_RDM;
 
+typedef struct {
+  uint32_t DeviceId;
+  uint16_t Channel;
+} DMX_RDM_Address;
+
+/***
+ *  Switch the TX pin between the UART and a GPIO for the break
+ ***/
+static inline void dmx_tx_pin(uint32_t mode) {
+  DMX_TX_GPIO_Port->CRL = (DMX_TX_GPIO_Port->CRL & ~(0xF << DMX_TX_CRL_SHIFT)) | (mode << DMX_TX_CRL_SHIFT);
+}
+
+/***
+ *  Start TIM5 as a one-shot timer in us
+ ***/
+static inline void dmx_timer_start(uint32_t us) {
+  TIM5->ARR = us;
+  TIM5->EGR = TIM_EGR_UG; // reload, does not trigger the interrupt because of URS
+  TIM5->CR1 |= TIM_CR1_CEN;
+}
+
+/***
+ *  Send the break in front of a DMX frame or an RDM packet
+ ***/
+static void dmx_start_break(void) {
+  DMX_TX_GPIO_Port->BRR = DMX_TX_Pin;
+  dmx_tx_pin(DMX_TX_CRL_GPIO);
+  gDMXState = eDMXState_break;
+  dmx_timer_start(DMX_BREAK_US);
+}
+
+/***
+ *  Start a new frame with the break. Takes the back buffer, if an update is waiting.
+ ***/
+static void dmx_start_frame(void) {
+  if (gDMXSwap) {
+    gDMXFront ^= 1;
+    gDMXSwap = false;
+  }
+  gDMXSendingRDM = false;
+  gRDMBurst = 0;
+  dmx_start_break();
+  ctl_events_set_clear(&gDMXEvent, eDMXEvent_frameStarted, 0);
+}
+
+/***
+ *  Continue with a waiting RDM packet or the next DMX frame. A burst of RDM transactions
+ *  is limited, so the fixtures still get their refresh during a discovery.
+ ***/
+static void dmx_start_next(void) {
+  if (gRDMPending and gRDMBurst < DMX_RDM_BURST) {
+    gRDMPending = false;
+    gDMXSendingRDM = true;
+    ++gRDMBurst;
+    dmx_start_break();
+  } else {
+    dmx_start_frame();
+  }
+}
+
+/***
+ *  The RDM packet is sent: turn the line around and receive the reply
+ ***/
+static void dmx_rdm_receive(void) {
+  HAL_GPIO_WritePin(DMX_TX_ENABLE_GPIO_Port, DMX_TX_ENABLE_Pin, GPIO_PIN_RESET);
+  DMA1_Channel6->CCR &= ~DMA_CCR_EN;
+  DMA1_Channel6->CMAR = (uint32_t)gRDMReply;
+  DMA1_Channel6->CNDTR = RDM_REPLY_MAX;
+  DMA1->IFCR = DMA_IFCR_CGIF6;
+  (void)USART2->SR; // clear pending errors and data from the own packet
+  (void)USART2->DR;
+  DMA1_Channel6->CCR |= DMA_CCR_EN;
+  SET_BIT(USART2->CR1, USART_CR1_IDLEIE);
+  gDMXState = eDMXState_rdmReply;
+  dmx_timer_start(DMX_RDM_REPLY_US);
+}
+
+/***
+ *  The RDM transaction is done, wait the minimum time before the next packet
+ ***/
+static void dmx_rdm_finish(void) {
+  if (gRDMExpectReply) {
+    CLEAR_BIT(USART2->CR1, USART_CR1_IDLEIE);
+    DMA1_Channel6->CCR &= ~DMA_CCR_EN;
+    gRDMReplySize = RDM_REPLY_MAX - DMA1_Channel6->CNDTR;
+    HAL_GPIO_WritePin(DMX_TX_ENABLE_GPIO_Port, DMX_TX_ENABLE_Pin, GPIO_PIN_SET);
+  } else {
+    gRDMReplySize = 0;
+  }
+  gDMXState = eDMXState_rdmGap;
+  dmx_timer_start(DMX_RDM_GAP_US);
+  ctl_events_set_clear(&gDMXEvent, eDMXEvent_rdmDone, 0);
+}
+
+/***
+ *  Build the gamma table
+ ***/
+static void dmx_init_gamma(void) {
+  for (int i = 0; i < 256; ++i)
+    gDMXGamma[i] = (i * i + 254) / 255;
+}
+
+/***
+ *  Setup USART2, DMA1 channel 7 (USART2_TX), channel 6 (USART2_RX) and TIM5. Done here and not in HAL_UART_MspInit(),
+ *  because several extensions with different UARTs can run on one board.
+ ***/
+static void dmx_hardware_init(void) {
+  __HAL_RCC_USART2_CLK_ENABLE();
+  __HAL_RCC_GPIOA_CLK_ENABLE();
+  __HAL_RCC_DMA1_CLK_ENABLE();
+  __HAL_RCC_TIM5_CLK_ENABLE();
+
+  GPIO_InitTypeDef GPIO_InitStruct = {0};
+  GPIO_InitStruct.Pin = DMX_TX_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+  HAL_GPIO_Init(DMX_TX_GPIO_Port, &GPIO_InitStruct);
+
+  GPIO_InitStruct.Pin = DMX_RX_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
+  GPIO_InitStruct.Pull = GPIO_PULLUP;
+  HAL_GPIO_Init(DMX_RX_GPIO_Port, &GPIO_InitStruct);
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+
+  // the RS485 driver is transmitting, except while an RDM reply is received
+  GPIO_InitStruct.Pin = DMX_TX_ENABLE_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+  HAL_GPIO_Init(DMX_TX_ENABLE_GPIO_Port, &GPIO_InitStruct);
+  HAL_GPIO_WritePin(DMX_TX_ENABLE_GPIO_Port, DMX_TX_ENABLE_Pin, GPIO_PIN_SET);
+
+  huart2.Instance = USART2;
+  huart2.Init.BaudRate = DMX_BAUDRATE;
+  huart2.Init.WordLength = UART_WORDLENGTH_8B;
+  huart2.Init.StopBits = UART_STOPBITS_2;
+  huart2.Init.Parity = UART_PARITY_NONE;
+  huart2.Init.Mode = UART_MODE_TX_RX;
+  huart2.Init.HwFlowCtl = UART_HWCONTROL_NONE;
+  huart2.Init.OverSampling = UART_OVERSAMPLING_16;
+  if (HAL_UART_Init(&huart2) != HAL_OK) {
+#if DEBUG
+    debug_printf("### DMX HAL_UART_Init ERROR\n");
+#endif
+  }
+  SET_BIT(USART2->CR3, USART_CR3_DMAT | USART_CR3_DMAR);
+  HAL_NVIC_SetPriority(USART2_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(USART2_IRQn);
+
+  // DMA1 channel 7: frame => USART2_TX, started after the mark after break
+  DMA1_Channel7->CCR = 0;
+  DMA1_Channel7->CPAR = (uint32_t)&USART2->DR;
+  DMA1_Channel7->CCR = DMA_CCR_PL_1 | DMA_CCR_MINC | DMA_CCR_DIR;
+
+  // DMA1 channel 6: USART2_RX => RDM reply, started after an RDM packet
+  DMA1_Channel6->CCR = 0;
+  DMA1_Channel6->CPAR = (uint32_t)&USART2->DR;
+  DMA1_Channel6->CCR = DMA_CCR_PL_1 | DMA_CCR_MINC;
+
+  // TIM5: one-shot timer in us for the break, the mark after break and the RDM timing
+  TIM5->CR1 = 0;
+  TIM5->PSC = 2 * HAL_RCC_GetPCLK1Freq() / 1000000 - 1; // APB1 prescaler != 1 => timer clock is doubled
+  TIM5->CR1 = TIM_CR1_OPM | TIM_CR1_URS;
+  TIM5->SR = 0;
+  TIM5->DIER = TIM_DIER_UIE;
+  HAL_NVIC_SetPriority(TIM5_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(TIM5_IRQn);
+}
+
 /***
  *  Constructor
  ***/
 LoxLegacyDMXExtension::LoxLegacyDMXExtension(LoxCANBaseDriver &driver, uint32_t serial)
-  : LoxLegacyExtension(driver, (serial & 0xFFFFFF) | (eDeviceType_t_DMXExtension << 24), eDeviceType_t_DMXExtension, 0, 10031107, fragData, sizeof(fragData)) {
+  : LoxLegacyExtension(driver, (serial & 0xFFFFFF) | (eDeviceType_t_DMXExtension << 24), eDeviceType_t_DMXExtension, 0, 10031107, fragData, sizeof(fragData)),
+    LoxRDMController(DMX_RDM_MANUFACTURER_ID, serial) {
+  memset(this->fadeCurrent, 0, sizeof(this->fadeCurrent));
+  memset(this->fadeStep, 0, sizeof(this->fadeStep));
+  memset(this->fadeTarget, 0, sizeof(this->fadeTarget));
+  memset(this->fadeFlags, 0, sizeof(this->fadeFlags));
+  this->fadeActiveCount = 0;
+  this->fadeChanged = false;
+  this->rdmDeviceCount = 0;
+  this->rdmReport = false;
+}
+
+/***
+ *  Setup the DMX line and start the continuous refresh
+ ***/
+void LoxLegacyDMXExtension::Startup(void) {
+  memset(gDMXFrame, 0, sizeof(gDMXFrame)); // start code 0x00 = dimmer data
+  dmx_init_gamma();
+  ctl_mutex_init(&this->fadeMutex);
+  ctl_events_init(&gDMXEvent, 0);
+  static uint8_t sRDMAddressBuffer[DMX_RDM_ADDRESS_QUEUE_SIZE];
+  ctl_byte_queue_init(&this->rdmAddressQueue, sRDMAddressBuffer, DMX_RDM_ADDRESS_QUEUE_SIZE);
+
+  static unsigned sDMXTaskStack[1 + DMX_TASK_STACKSIZE + 1];
+  static CTL_TASK_t sDMXTask;
+  monitor_task_run(&sDMXTask, 0x0C, LoxLegacyDMXExtension::vDMXTask, this, "DMX", DMX_TASK_STACKSIZE, sDMXTaskStack);
+  static unsigned sRDMTaskStack[1 + DMX_RDM_TASK_STACKSIZE + 1];
+  static CTL_TASK_t sRDMTask;
+  monitor_task_run(&sRDMTask, 0x0B, LoxLegacyDMXExtension::vRDMTask, this, "RDM", DMX_RDM_TASK_STACKSIZE, sRDMTaskStack);
+
+  dmx_hardware_init();
+  dmx_start_frame();
+}
+
+/***
+ *  Fade consecutive slots, starting at a DMX channel (1..512), to new values. The fade either takes
+ *  a number of frames or runs with a rate (8.16 per frame). Without both the value is set immediately.
+ ***/
+void LoxLegacyDMXExtension::fade_slots(uint16_t channel, const uint8_t *values, int count, bool gamma, uint32_t rate, uint32_t frames) {
+  if (channel < 1 or channel + count - 1 > DMX_SLOTS)
+    return;
+  ctl_mutex_lock(&this->fadeMutex, CTL_TIMEOUT_NONE, 0);
+  for (int i = 0; i < count; ++i) {
+    int slot = channel - 1 + i;
+    int32_t delta = (values[i] << 16) - this->fadeCurrent[slot];
+    int32_t step = 0;
+    if (frames > 0)
+      step = delta / int32_t(frames);
+    else if (rate > 0)
+      step = delta > 0 ? int32_t(rate) : -int32_t(rate);
+    if (step == 0 and delta != 0 and (frames > 0 or rate > 0)) // slower than the resolution
+      step = delta > 0 ? 1 : -1;
+    this->fadeTarget[slot] = values[i];
+    this->fadeStep[slot] = step; // a slot without a step is removed from the list by fade_advance()
+    uint8_t flags = this->fadeFlags[slot] & eDMXFadeFlags_active;
+    if (gamma)
+      flags |= eDMXFadeFlags_gamma;
+    if (step == 0) {
+      this->fadeCurrent[slot] = values[i] << 16;
+    } else if (!(flags & eDMXFadeFlags_active)) {
+      this->fadeActive[this->fadeActiveCount++] = slot;
+      flags |= eDMXFadeFlags_active;
+    }
+    this->fadeFlags[slot] = flags;
+  }
+  this->fadeChanged = true;
+  ctl_mutex_unlock(&this->fadeMutex);
+}
+
+/***
+ *  Advance all fading slots by one frame
+ ***/
+void LoxLegacyDMXExtension::fade_advance(void) {
+  int i = 0;
+  while (i < this->fadeActiveCount) {
+    int slot = this->fadeActive[i];
+    int32_t step = this->fadeStep[slot];
+    int32_t target = this->fadeTarget[slot] << 16;
+    int32_t current = this->fadeCurrent[slot] + step;
+    if (step == 0 or (step > 0 ? current >= target : current <= target)) { // done
+      this->fadeCurrent[slot] = target;
+      this->fadeStep[slot] = 0;
+      this->fadeFlags[slot] &= ~eDMXFadeFlags_active;
+      this->fadeActive[i] = this->fadeActive[--this->fadeActiveCount];
+    } else {
+      this->fadeCurrent[slot] = current;
+      ++i;
+    }
+  }
+}
+
+/***
+ *  Write the current values of all slots into a frame buffer
+ ***/
+void LoxLegacyDMXExtension::fade_render(uint8_t *slots) const {
+  for (int slot = 0; slot < DMX_SLOTS; ++slot) {
+    uint8_t value = (this->fadeCurrent[slot] + 0x8000) >> 16;
+    slots[slot] = (this->fadeFlags[slot] & eDMXFadeFlags_gamma) ? gDMXGamma[value] : value;
+  }
+}
+
+/***
+ *  DMX Task: renders the next frame into the back buffer at the start of every frame,
+ *  as long as something changed.
+ ***/
+void LoxLegacyDMXExtension::vDMXTask(void *pvParameters) {
+  LoxLegacyDMXExtension *_this = (LoxLegacyDMXExtension *)pvParameters;
+  while (1) {
+    ctl_events_wait(CTL_EVENT_WAIT_ANY_EVENTS_WITH_AUTO_CLEAR, &gDMXEvent, eDMXEvent_frameStarted, CTL_TIMEOUT_NONE, 0);
+    ctl_mutex_lock(&_this->fadeMutex, CTL_TIMEOUT_NONE, 0);
+    if (_this->fadeActiveCount > 0 or _this->fadeChanged) {
+      _this->fadeChanged = false;
+      _this->fade_advance();
+      gDMXSwap = false; // the back buffer must not become the front while it is written
+      _this->fade_render(&gDMXFrame[gDMXFront ^ 1][1]);
+      __DMB(); // the buffer is written, before the interrupt can take it
+      gDMXSwap = true;
+    }
+    ctl_mutex_unlock(&_this->fadeMutex);
+  }
+}
+
+/***
+ *  Send an RDM packet between two DMX frames and wait for the reply. Called by the RDM task.
+ ***/
+int LoxLegacyDMXExtension::Transact(const uint8_t *packet, int size, uint8_t *reply, int replySize, bool expectReply) {
+  memcpy(gRDMPacket, packet, size);
+  gRDMPacketSize = size;
+  gRDMExpectReply = expectReply;
+  ctl_events_set_clear(&gDMXEvent, 0, eDMXEvent_rdmDone);
+  __DMB(); // the packet is complete, before the interrupt can take it
+  gRDMPending = true;
+  if (!ctl_events_wait(CTL_EVENT_WAIT_ANY_EVENTS_WITH_AUTO_CLEAR, &gDMXEvent, eDMXEvent_rdmDone, CTL_TIMEOUT_DELAY, DMX_RDM_TIMEOUT_MS)) {
+    gRDMPending = false;
+    return 0;
+  }
+  int count = gRDMReplySize;
+  if (count > replySize)
+    count = replySize;
+  memcpy(reply, gRDMReply, count);
+  return count;
+}
+
+/***
+ *  A new device was muted during the discovery. The Miniserver gets the devices one after the other,
+ *  the previous one is sent now, because the last one has to be marked as such.
+ ***/
+bool LoxLegacyDMXExtension::DeviceFound(uint64_t uid) {
+  for (int i = 0; i < this->rdmDeviceCount; ++i) {
+    if (this->rdmDevices[i].uid == uid)
+      return false;
+  }
+  if (this->rdmDeviceCount >= DMX_RDM_MAX_DEVICES) {
+#if DEBUG
+    debug_printf("### RDM device table full\n");
+#endif
+    return true;
+  }
+  int address = GetStartAddress(uid);
+  if (this->rdmReport and this->rdmDeviceCount > 0) {
+    const tDMXRDMDevice &previous = this->rdmDevices[this->rdmDeviceCount - 1];
+    search_reply(previous.channel, previous.uid >> 32, previous.uid, false);
+  }
+  this->rdmDevices[this->rdmDeviceCount].uid = uid;
+  this->rdmDevices[this->rdmDeviceCount].channel = address > 0 ? address : 0;
+  ++this->rdmDeviceCount;
+  return true;
+}
+
+/***
+ *  Discover all RDM devices on the line, optionally report them to the Miniserver
+ ***/
+void LoxLegacyDMXExtension::rdm_search(bool report) {
+  this->rdmDeviceCount = 0;
+  this->rdmReport = report;
+  int count = Discover();
+  debug_printf("RDM: %d devices found\n", count);
+  if (!report)
+    return;
+  if (this->rdmDeviceCount == 0) {
+    search_reply(0, 0, 0, true); // no devices found
+  } else {
+    const tDMXRDMDevice &last = this->rdmDevices[this->rdmDeviceCount - 1];
+    search_reply(last.channel, last.uid >> 32, last.uid, true);
+  }
+}
+
+/***
+ *  Set the DMX start address of a device, which was reported by the last search
+ ***/
+void LoxLegacyDMXExtension::rdm_set_address(uint32_t deviceID, uint16_t channel) {
+  for (int pass = 0; pass < 2; ++pass) {
+    for (int i = 0; i < this->rdmDeviceCount; ++i) {
+      if (uint32_t(this->rdmDevices[i].uid) != deviceID)
+        continue;
+      if (this->rdmDevices[i].channel != channel and SetStartAddress(this->rdmDevices[i].uid, channel))
+        this->rdmDevices[i].channel = channel;
+      return;
+    }
+    if (pass == 0) // unknown device, e.g. after a restart: search again without reporting
+      rdm_search(false);
+  }
+  debug_printf("RDM: device 0x%08x not found\n", deviceID);
+}
+
+/***
+ *  RDM Task: runs the device search and sets the start addresses. The transactions are
+ *  sent by the interrupts between the DMX frames.
+ ***/
+void LoxLegacyDMXExtension::vRDMTask(void *pvParameters) {
+  LoxLegacyDMXExtension *_this = (LoxLegacyDMXExtension *)pvParameters;
+  while (1) {
+    unsigned events = ctl_events_wait(CTL_EVENT_WAIT_ANY_EVENTS_WITH_AUTO_CLEAR, &gDMXEvent, eDMXEvent_rdmSearch | eDMXEvent_rdmAddress, CTL_TIMEOUT_NONE, 0);
+    if (events & eDMXEvent_rdmSearch)
+      _this->rdm_search(true);
+    DMX_RDM_Address address;
+    while (ctl_byte_queue_receive_multi_nb(&_this->rdmAddressQueue, sizeof(address), (uint8_t *)&address) == sizeof(address))
+      _this->rdm_set_address(address.DeviceId, address.Channel);
+  }
+}
+
+/***
+ *  Slot values of an actor, returns the number of slots, starting at the actor channel
+ ***/
+static int dmx_actor_values(const DMX_Actor *actor, uint8_t *values) {
+  switch (actor->Type & 3) { // "Smart" (RDM) devices have the same layout
+  case 0:                    // Standard
+    values[0] = actor->Data[0];
+    return 1;
+  case 1: // RGB
+    memcpy(values, actor->Data, 3);
+    return 3;
+  case 2: // RGBW
+    memcpy(values, actor->Data, 4);
+    return 4;
+  case 3:                        // Lumitech
+    if (actor->Data[0] == 101) { // RGB, the data is red, blue, green
+      values[0] = actor->Data[1];
+      values[1] = actor->Data[3];
+      values[2] = actor->Data[2];
+      return 3;
+    }
+    values[0] = actor->Data[1]; // Dual White: brightness, color temperature
+    values[1] = actor->Data[2];
+    return 2;
+  }
+  return 0;
+}
+
+/***
+ *  Fade rate (8.16 per frame) for a slewrate in % per second, 0 = no fade
+ ***/
+static uint32_t dmx_slewrate_rate(uint8_t slewrate) {
+  return (uint32_t(255 << 16) / 100) * (slewrate & 0x7F) / DMX_FRAME_RATE_HZ;
+}
+
+/***
+ *  Number of frames for a time in ms, at least 1 for any time > 0
+ ***/
+static uint32_t dmx_time_frames(uint32_t timeInMs) {
+  uint32_t frames = timeInMs * DMX_FRAME_RATE_HZ / 1000;
+  return (frames == 0 and timeInMs > 0) ? 1 : frames;
 }
 
 /***
@@ -60,12 +545,7 @@ void LoxLegacyDMXExtension::PacketToExtension(LoxCanMessage &message) {
   switch (message.commandLegacy) {
   case dmx_search:
     debug_printf("Search for DMX devices\n");
-    if (true) {
-      search_reply(0, 0x2637, 0xE0D80800, false); // 0xDxxxxxxx doesn't support Slewrate and it will be set to 0. 0xExxxxxxx works fine.
-      search_reply(4, 0x5431, 0xaabbccdd, true);
-    } else {
-      search_reply(0, 0, 0, true); // no devices found
-    }
+    ctl_events_set_clear(&gDMXEvent, eDMXEvent_rdmSearch, 0); // the RDM task replies
     break;
   case DMX_learn:
     debug_printf("Learn DMX: %d %d\n", message.data[0] | (message.data[1] << 8), message.data[2]);
@@ -111,24 +591,29 @@ void LoxLegacyDMXExtension::FragmentedPacketToExtension(LoxMsgLegacyFragmentedCo
   // data[3] = Green in % (0-255 => 0-100%)
 
   // Gamma == is the perception correction in the Loxone Config. It means that the output value is squared before transmission.
+  uint8_t values[4];
   switch (fragCommand) {
   case FragCmd_DMX_actor: {
     const DMX_Actor *package = (const DMX_Actor *)fragData;
     const char *const gammaStr = ((package->Slewrate & 0x80) == 0x80) ? "yes" : "no";
     debug_printf("DMX actor: Type:%s, Slewrate: %d%%, Gamma:%s, Channel:%d, Data:%d %d %d %d\n", DMX_DeviceTypeString(package->Type), package->Slewrate & 0x7F, gammaStr, package->Channel, package->Data[0], package->Data[1], package->Data[2], package->Data[3]);
+    int count = dmx_actor_values(package, values);
+    fade_slots(package->Channel, values, count, package->Slewrate & 0x80, dmx_slewrate_rate(package->Slewrate), 0);
     break;
   }
   case FragCmd_DMX_dimming: {
     const DMX_Dimming *package = (const DMX_Dimming *)fragData;
     const char *const gammaStr = ((package->actor.Slewrate & 0x80) == 0x80) ? "yes" : "no";
     debug_printf("DMX dimming: Type:%s, Slewrate: %d%%, Gamma:%s, Channel:%d, Data:%d %d %d %d, DeviceId:0x%08x\n", DMX_DeviceTypeString(package->actor.Type), package->actor.Slewrate & 0x7F, gammaStr, package->actor.Channel, package->actor.Data[0], package->actor.Data[1], package->actor.Data[2], package->actor.Data[3], package->DeviceId);
+    int count = dmx_actor_values(&package->actor, values);
+    fade_slots(package->actor.Channel, values, count, package->actor.Slewrate & 0x80, dmx_slewrate_rate(package->actor.Slewrate), 0);
     break;
   }
   case FragCmd_DMX_composite_actor: {
     const DMX_Composite *package = (const DMX_Composite *)fragData;
     const char *const gammaStr = ((package->actor.Slewrate & 0x80) == 0x80) ? "yes" : "no";
-    uint16_t timeInMs = package->Time * 100; // time in 100ms units
-    if (timeInMs & 0x4000)                   // time in seconds?
+    uint32_t timeInMs = (package->Time & 0x3FFF) * 100; // time in 100ms units
+    if (package->Time & 0x4000)                         // time in seconds?
       timeInMs *= 10;
     const char *const percentStr = ((package->Time & 0x8000) == 0x8000) ? "/100%" : "";
     if (package->actor.Type == 11) {       // Lumitech
@@ -140,6 +625,15 @@ void LoxLegacyDMXExtension::FragmentedPacketToExtension(LoxMsgLegacyFragmentedCo
     } else {
       debug_printf("DMX composite: Type:%s, Slewrate: %d%%, Gamma:%s, Channel:%d, Data:%.1f%% %.1f%% %.1f%% %.1f%%, Time:%dms%s\n", DMX_DeviceTypeString(package->actor.Type), package->actor.Slewrate & 0x7F, gammaStr, package->actor.Channel, package->actor.Data[0] * 100.0 / 255, package->actor.Data[1] * 100.0 / 255, package->actor.Data[2] * 100.0 / 255, package->actor.Data[3] * 100.0 / 255, timeInMs, percentStr);
     }
+    int count = dmx_actor_values(&package->actor, values);
+    uint32_t frames = dmx_time_frames(timeInMs);
+    if (frames == 0) { // no time, fade with the slewrate
+      fade_slots(package->actor.Channel, values, count, package->actor.Slewrate & 0x80, dmx_slewrate_rate(package->actor.Slewrate), 0);
+    } else if (package->Time & 0x8000) { // the time is for 0..100%, the fade runs with the resulting rate
+      fade_slots(package->actor.Channel, values, count, package->actor.Slewrate & 0x80, uint32_t(255 << 16) / frames, 0);
+    } else { // the fade takes the time
+      fade_slots(package->actor.Channel, values, count, package->actor.Slewrate & 0x80, 0, frames);
+    }
     break;
   }
   case FragCmd_DMX_init_rdm_device: {
@@ -149,6 +643,9 @@ void LoxLegacyDMXExtension::FragmentedPacketToExtension(LoxMsgLegacyFragmentedCo
       package->Gamma[0], package->Gamma[1], package->Gamma[2], package->Gamma[3],
       package->RGBW[0], package->RGBW[1], package->RGBW[2], package->RGBW[3],
       package->Channel, package->DeviceId);
+    DMX_RDM_Address address = {package->DeviceId, package->Channel};
+    if (ctl_byte_queue_post_multi_nb(&this->rdmAddressQueue, sizeof(address), (uint8_t *)&address) == sizeof(address))
+      ctl_events_set_clear(&gDMXEvent, eDMXEvent_rdmAddress, 0);
     break;
   }
   default:
@@ -161,3 +658,59 @@ void LoxLegacyDMXExtension::StartRequest()
 {
     sendCommandWithValues(config_checksum, 0, 0, 0); // required, otherwise it is considered offline
 }
+
+/***
+ *  TIM5: end of the break, of the mark after break or of an RDM timing
+ ***/
+extern "C" void TIM5_IRQHandler(void) {
+  MONITOR_ISR_ENTER();
+  TIM5->SR = 0;
+  if (gDMXState == eDMXState_break) {
+    DMX_TX_GPIO_Port->BSRR = DMX_TX_Pin;
+    gDMXState = eDMXState_mab;
+    dmx_timer_start(DMX_MAB_US);
+  } else if (gDMXState == eDMXState_mab) {
+    dmx_tx_pin(DMX_TX_CRL_AF);
+    gDMXState = eDMXState_data;
+    DMA1_Channel7->CCR &= ~DMA_CCR_EN;
+    if (gDMXSendingRDM) {
+      DMA1_Channel7->CMAR = (uint32_t)gRDMPacket;
+      DMA1_Channel7->CNDTR = gRDMPacketSize;
+    } else {
+      DMA1_Channel7->CMAR = (uint32_t)gDMXFrame[gDMXFront];
+      DMA1_Channel7->CNDTR = 1 + DMX_SLOTS;
+    }
+    DMA1->IFCR = DMA_IFCR_CGIF7;
+    CLEAR_BIT(USART2->SR, USART_SR_TC);
+    DMA1_Channel7->CCR |= DMA_CCR_EN;
+    SET_BIT(USART2->CR1, USART_CR1_TCIE);
+  } else if (gDMXState == eDMXState_rdmReply) { // no reply or the line is idle after it
+    dmx_rdm_finish();
+  } else if (gDMXState == eDMXState_rdmGap) {
+    dmx_start_next();
+  }
+  MONITOR_ISR_LEAVE(eMonitorISR_USART2); // accounted to the UART it serves
+}
+
+/***
+ *  USART2: the last stop bit of a packet is sent or the line is idle after bytes of an RDM reply
+ ***/
+extern "C" void USART2_IRQHandler(void) {
+  MONITOR_ISR_ENTER();
+  uint32_t sr = USART2->SR;
+  if ((sr & USART_SR_IDLE) and (USART2->CR1 & USART_CR1_IDLEIE)) {
+    (void)USART2->DR;                    // clears IDLE
+    dmx_timer_start(DMX_RDM_REPLY_END_US); // the reply is complete, unless more bytes follow
+  }
+  if ((sr & USART_SR_TC) and (USART2->CR1 & USART_CR1_TCIE)) {
+    CLEAR_BIT(USART2->CR1, USART_CR1_TCIE);
+    if (!gDMXSendingRDM)
+      dmx_start_next();
+    else if (gRDMExpectReply)
+      dmx_rdm_receive();
+    else
+      dmx_rdm_finish();
+  }
+  MONITOR_ISR_LEAVE(eMonitorISR_USART2);
+}
+#endif
@@ -9,9 +9,57 @@
 #define LoxLegacyDMXExtension_hpp
 
 #include "LoxLegacyExtension.hpp"
+#if EXTENSION_DMX
+#include "LoxRDMController.hpp"
+#include <ctl_api.h>
 
-class LoxLegacyDMXExtension : public LoxLegacyExtension {
+#define DMX_SLOTS 512    // slots per universe, the start code is sent in front of them
+#define DMX_BREAK_US 176 // >= 88us
+#define DMX_MAB_US 12    // mark after break, >= 8us
+#define DMX_FRAME_RATE_HZ 44 // continuous refresh with all slots
+#define DMX_TASK_STACKSIZE 128
+#define DMX_RDM_MANUFACTURER_ID 0x7FF0 // prototype range of the ESTA manufacturer IDs
+#define DMX_RDM_MAX_DEVICES 128
+#define DMX_RDM_TASK_STACKSIZE 256
+
+typedef enum {
+  eDMXFadeFlags_gamma = 0x01,  // output via the gamma table
+  eDMXFadeFlags_active = 0x02, // in the list of fading slots
+} eDMXFadeFlags;
+
+typedef struct {
+  uint64_t uid;
+  uint16_t channel; // DMX start address, 0 = unknown
+} tDMXRDMDevice;
+
+class LoxLegacyDMXExtension : public LoxLegacyExtension, LoxRDMController {
   uint8_t fragData[36]; // fragmented package
+  // fade engine, values are in 8.16 fixed point
+  CTL_MUTEX_t fadeMutex;
+  int32_t fadeCurrent[DMX_SLOTS];
+  int32_t fadeStep[DMX_SLOTS]; // per frame, 0 = not fading
+  uint8_t fadeTarget[DMX_SLOTS];
+  uint8_t fadeFlags[DMX_SLOTS]; // eDMXFadeFlags
+  uint16_t fadeActive[DMX_SLOTS]; // slots, which are in the list
+  int fadeActiveCount;
+  bool fadeChanged; // the output has to be rendered again
+
+  void fade_slots(uint16_t channel, const uint8_t *values, int count, bool gamma, uint32_t rate, uint32_t frames);
+  void fade_advance(void);
+  void fade_render(uint8_t *slots) const;
+  static void vDMXTask(void *pvParameters);
+
+  tDMXRDMDevice rdmDevices[DMX_RDM_MAX_DEVICES]; // found by the last discovery
+  int rdmDeviceCount;
+  bool rdmReport;                   // send the found devices to the Miniserver
+  CTL_BYTE_QUEUE_t rdmAddressQueue; // start addresses to set, for the RDM task
+
+  void rdm_search(bool report);
+  void rdm_set_address(uint32_t deviceID, uint16_t channel);
+  static void vRDMTask(void *pvParameters);
+  virtual int Transact(const uint8_t *packet, int size, uint8_t *reply, int replySize, bool expectReply);
+  virtual bool DeviceFound(uint64_t uid);
+
   virtual void PacketToExtension(LoxCanMessage &message);
   virtual void FragmentedPacketToExtension(LoxMsgLegacyFragmentedCommand_t fragCommand, const void *fragData, int size);
   virtual void StartRequest();
@@ -21,6 +69,9 @@ class LoxLegacyDMXExtension : public LoxLegacyExtension {
 
 public:
   LoxLegacyDMXExtension(LoxCANBaseDriver &driver, uint32_t serial);
+
+  virtual void Startup(void);
 };
+#endif
 
 #endif /* LoxLegacyDMXExtension_hpp */
\ No newline at end of file
@@ -7,8 +7,10 @@
 
 #include "LoxLegacyExtension.hpp"
 #include "LED.hpp"
+#include "Monitor.hpp"
 #include "stm32f1xx_ll_cortex.h"
 #include "global_functions.hpp"
+#include <__cross_studio_io.h>
 #include <assert.h>
 #include <stdio.h>
 #include <string.h>
@@ -20,7 +22,7 @@ extern "C" {
  *  Constructor
  ***/
 LoxLegacyExtension::LoxLegacyExtension(LoxCANBaseDriver &driver, uint32_t serial, eDeviceType_t device_type, uint8_t hardware_version, uint32_t version, void *fragPtr, uint16_t fragMaxSize)
-  : LoxExtension(driver, serial, device_type, hardware_version, version), aliveCountdown(0), isMuted(false), forceStartMessage(true), firmwareUpdateActive(false), fragPtr(fragPtr), fragMaxSize(fragMaxSize) {
+  : LoxExtension(driver, serial, device_type, hardware_version, version), aliveCountdown(0), isMuted(false), forceStartMessage(true), firmwareUpdateActive(false), fragTimeout(0), fragPtr(fragPtr), fragMaxSize(fragMaxSize) {
   if(this->fragPtr == NULL || this->fragMaxSize < sizeof(this->fragMinimalPackage))
     this->fragPtr = this->fragMinimalPackage;
   if(this->fragMaxSize < sizeof(this->fragMinimalPackage))
@@ -52,62 +54,96 @@ void LoxLegacyExtension::sendCommandWithValues(LoxMsgLegacyCommand_t command, ui
  *  Send a fragmented command to the Miniserver
  ***/
 void LoxLegacyExtension::send_fragmented_message(LoxMsgLegacyFragmentedCommand_t fragCommand, const void *buffer, uint32_t byteCount) {
+  send_fragmented_message(fragCommand, buffer, byteCount, NULL, 0);
+}
+
+/***
+ *  Send a fragmented command to the Miniserver. The data is the concatenation of two buffers,
+ *  which allows sending e.g. a frame wrapping around the end of a ring buffer without copying it.
+ ***/
+void LoxLegacyExtension::send_fragmented_message(LoxMsgLegacyFragmentedCommand_t fragCommand, const void *buffer1, uint32_t byteCount1, const void *buffer2, uint32_t byteCount2) {
+  uint32_t byteCount = byteCount1 + byteCount2;
   // never send fragmented package if the extension is not active, except for the page CRC command.
   if ((this->state != eDeviceState_online or this->isMuted) and FragCmd_page_CRC_external != fragCommand)
     return;
+  if (byteCount >= 0x10000) // max. 64kb
+    return;
+  this->fragmentSender.Begin(buffer1, byteCount1, buffer2, byteCount2);
   LoxCanMessage message;
   message.serial = this->serial;
   message.hardwareType = eDeviceType_t(this->device_type);
   message.directionLegacy = LoxMsgLegacyDirection_t_fromDevice;
   message.commandDirection = LoxMsgLegacyCommandDirection_t_fromDevice;
-  if (byteCount > 1530) {      // large fragmented packages
-    if (byteCount < 0x10000) { // max. 64kb
-      message.commandLegacy = fragmented_package_large_start;
-      message.data[0] = 0x00; // unused for the large fragmented package
-      message.data[1] = fragCommand;
-      message.data[2] = 0x00; // unused
-      message.data[3] = byteCount;
-      message.data[4] = byteCount >> 8;
-      uint16_t checksum = 0x0000;
-      for (int i = 0; i < byteCount; ++i)
-        checksum += ((uint8_t *)buffer)[i];
-      message.data[5] = checksum;
-      message.data[6] = checksum >> 8;
-      driver.SendMessage(message);
-      if (byteCount > 0) {
-        message.commandLegacy = fragmented_package_large_data; // 7 bytes per package
-        for (uint32_t offset = 0; offset < byteCount; offset += 7) {
-          int count = byteCount - offset;
-          if (count > 7)
-            count = 7;
-          memmove(&message.data[0], ((uint8_t *)buffer) + offset, count);
-          driver.SendMessage(message);
-        }
-      }
-    }
-  } else { // smaller fragmented package (6 bytes per package * 255 packages = 1530 bytes maximum size)
-    message.commandLegacy = fragmented_package;
-    message.data[0] = 0x00; // package index 0 = header
-    message.data[1] = fragCommand;
-    message.data[2] = 0x00; // unused
-    message.data[3] = byteCount;
-    message.data[4] = byteCount >> 8;
-    uint16_t checksum = 0x0000;
-    for (int i = 0; i < byteCount; ++i)
-      checksum += ((uint8_t *)buffer)[i];
-    message.data[5] = checksum;
-    message.data[6] = checksum >> 8;
-    driver.SendMessage(message);
-    if (byteCount > 0) {
-      for (uint32_t offset = 0; offset < byteCount; offset += 6) {
-        ++message.data[0]; // package index
-        int count = byteCount - offset;
-        if (count > 6)
-          count = 6;
-        memmove(&message.data[1], ((uint8_t *)buffer) + offset, count);
-        driver.SendMessage(message);
-      }
-    }
+  bool large = byteCount > 1530; // smaller fragmented packages have 6 bytes per package * 255 packages = 1530 bytes maximum size
+  message.commandLegacy = large ? fragmented_package_large_start : fragmented_package;
+  message.data[0] = 0x00; // package index 0 = header, unused for the large fragmented package
+  message.data[1] = fragCommand;
+  message.data[2] = 0x00; // unused
+  message.data[3] = byteCount;
+  message.data[4] = byteCount >> 8;
+  uint16_t checksum = this->fragmentSender.Checksum();
+  message.data[5] = checksum;
+  message.data[6] = checksum >> 8;
+  this->fragmentSender.Send(message);
+  if (large) {
+    message.commandLegacy = fragmented_package_large_data; // 7 bytes per package
+    this->fragmentSender.SendData(message, eFragmentPackage_plain);
+  } else {
+    this->fragmentSender.SendData(message, eFragmentPackage_indexed);
+  }
+  this->fragmentSender.End();
+}
+
+/***
+ *  Header of a fragmented package received: start collecting the data packages
+ ***/
+void LoxLegacyExtension::frag_start(const LoxFragHeader *header, int packageSize) {
+  memmove(&this->fragHeader, header, sizeof(this->fragHeader));
+  memset(this->fragReceived, 0, sizeof(this->fragReceived));
+  this->fragPackageSize = packageSize;
+  this->fragPackages = (this->fragHeader.size + packageSize - 1) / packageSize;
+  this->fragPackageCount = 0;
+  this->fragChecksum = 0;
+  this->fragTimeout = LEGACY_FRAG_TIMEOUT_MS;
+  if (this->fragHeader.size == 0 or this->fragHeader.size > this->fragMaxSize) { // doesn't fit into the buffer
+#if DEBUG
+    debug_printf("Fragment 0x%02x with %d bytes dropped\n", this->fragHeader.fragCommand, this->fragHeader.size);
+#endif
+    this->fragTimeout = 0;
+  }
+}
+
+/***
+ *  Data package of a fragmented package received. The packages are tracked in a bitmap,
+ *  so they can arrive in any order and duplicates are ignored. The fragment is complete,
+ *  once all packages have arrived, independent of which package was the last one.
+ ***/
+void LoxLegacyExtension::frag_data(int index, const uint8_t *data) {
+  if (this->fragTimeout <= 0 or index >= this->fragPackages) // no fragment in progress or invalid package
+    return;
+  if (index < int(sizeof(this->fragReceived) * 8)) {
+    uint32_t mask = 1 << (index & 31);
+    if (this->fragReceived[index >> 5] & mask) // duplicate package, e.g. after a retransmission
+      return;
+    this->fragReceived[index >> 5] |= mask;
+  }
+  int offset = index * this->fragPackageSize;
+  int count = this->fragHeader.size - offset;
+  if (count > this->fragPackageSize)
+    count = this->fragPackageSize;
+  memmove((uint8_t *)this->fragPtr + offset, data, count);
+  for (int i = 0; i < count; ++i)
+    this->fragChecksum += data[i];
+  this->fragTimeout = LEGACY_FRAG_TIMEOUT_MS;
+  if (++this->fragPackageCount < this->fragPackages)
+    return;
+  this->fragTimeout = 0;
+  if (this->fragChecksum == this->fragHeader.checksum) {
+    FragmentedPacketToExtension(LoxMsgLegacyFragmentedCommand_t(this->fragHeader.fragCommand), this->fragPtr, this->fragHeader.size);
+  } else {
+#if DEBUG
+    debug_printf("Fragment 0x%02x checksum error\n", this->fragHeader.fragCommand);
+#endif
   }
 }
 
@@ -120,6 +156,28 @@ void LoxLegacyExtension::sendCommandWithVersion(LoxMsgLegacyCommand_t command) {
   sendCommandWithValues(command, this->hardware_version, 0, this->version);
 }
 
+/***
+ *  Send the runtime statistics of the firmware as monitor_statistics messages, see LoxCanMessage.hpp
+ *  for the layout. The CPU load is measured since the previous request.
+ ***/
+void LoxLegacyExtension::sendStatistics(void) {
+  for (int i = 0; i < monitor_task_count(); ++i) {
+    tMonitorTaskInfo info;
+    monitor_task_info(i, &info);
+    uint16_t stackUsed = info.stackOverflow ? 0xFFFF : info.stackUsed;
+    sendCommandWithValues(monitor_statistics, i, info.loadPermille, (info.stackSize << 16) | stackUsed);
+  }
+  for (int i = 0; i < eMonitorISR_count; ++i) {
+    tMonitorISRInfo info;
+    monitor_isr_info(eMonitorISR(i), &info);
+    sendCommandWithValues(monitor_statistics, 0x80 + i, info.loadPermille, info.maxCycles);
+  }
+#if DEBUG
+  monitor_print();
+#endif
+  monitor_reset();
+}
+
 /***
  *  10ms Timer to be called 100x per second
  ***/
@@ -138,6 +196,15 @@ void LoxLegacyExtension::Timer10ms(void) {
   if (resetAliveCountdown)
     this->aliveCountdown = 1000 * ((this->serial & 0x3f) + 6 * 60); // avoid that all alive packages from all extensions are sent at the same time
   this->aliveCountdown -= 10;
+  if (this->fragTimeout > 0) {
+    this->fragTimeout -= 10;
+    if (this->fragTimeout <= 0) { // missing packages, drop the fragment
+#if DEBUG
+      debug_printf("Fragment 0x%02x timeout, %d of %d packages\n", this->fragHeader.fragCommand, this->fragPackageCount, this->fragPackages);
+#endif
+      this->fragTimeout = 0;
+    }
+  }
 }
 
 /***
@@ -241,58 +308,27 @@ void LoxLegacyExtension::PacketToExtension(LoxCanMessage &message) {
   case mute_all:
     this->isMuted = true;
     break;
+  case request_statistics:
+    sendStatistics();
+    break;
   case fragmented_package:      // package size less then 1530 bytes (255 * 6 byte)
     if (this->fragMaxSize == 0) // no fragmented messages expected?
       break;
     if (header->packageIndex == 0) { // header
-      memmove(&this->fragHeader, header, sizeof(this->fragHeader));
+      frag_start(header, 6);
     } else { // data block with 6 bytes of data
-      int currentSize = (header->packageIndex - 1) * 6;
-      if (currentSize < this->fragMaxSize) {
-        int count = this->fragMaxSize - currentSize;
-        if (count > 6)
-          count = 6;
-        memmove((uint8_t *)this->fragPtr + currentSize, message.data + 1, count);
-        currentSize += count;
-        if (currentSize >= this->fragHeader.size) {
-          uint16_t checksum = 0;
-          for (int i = 0; i < this->fragHeader.size; ++i) {
-            checksum += ((uint8_t *)this->fragPtr)[i];
-          }
-          if (checksum == this->fragHeader.checksum) {
-            FragmentedPacketToExtension(LoxMsgLegacyFragmentedCommand_t(this->fragHeader.fragCommand), this->fragPtr, this->fragHeader.size);
-          }
-        }
-      }
+      frag_data(header->packageIndex - 1, message.data + 1);
     }
     break;
-  case fragmented_package_large_data: { // package size less then 64kb, each message contains 7 bytes of data
-    if (this->fragMaxSize == 0)         // no fragmented messages expected?
+  case fragmented_package_large_data: // package size less then 64kb, each message contains 7 bytes of data
+    if (this->fragMaxSize == 0)       // no fragmented messages expected?
       break;
-    int currentSize = this->fragLargeIndex++ * 7;
-    if (currentSize < this->fragMaxSize) {
-      int count = this->fragMaxSize - currentSize;
-      if (count > 7)
-        count = 7;
-      memmove((uint8_t *)this->fragPtr + currentSize, message.data, count);
-      currentSize += count;
-      if (currentSize >= this->fragHeader.size) {
-        uint16_t checksum = 0;
-        for (int i = 0; i < this->fragHeader.size; ++i) {
-          checksum += ((uint8_t *)this->fragPtr)[i];
-        }
-        if (checksum == this->fragHeader.checksum) {
-          FragmentedPacketToExtension(LoxMsgLegacyFragmentedCommand_t(this->fragHeader.fragCommand), this->fragPtr, this->fragHeader.size);
-        }
-      }
-    }
+    frag_data(this->fragPackageCount, message.data); // no package index, CAN keeps the order of the messages
     break;
-  }
   case fragmented_package_large_start:
     if (this->fragMaxSize == 0) // no fragmented messages expected?
       break;
-    memmove(&this->fragHeader, header, sizeof(this->fragHeader));
-    this->fragLargeIndex = 0;
+    frag_start(header, 7);
     break;
   default:
     break;
@@ -320,24 +356,24 @@ void LoxLegacyExtension::FragmentedPacketToExtension(LoxMsgLegacyFragmentedComma
   case FragCmd_CryptoChallengeRequest: // The authorization scheme is identical to the NAT extensions
     static uint32_t decryptData[4]; // 16 bytes
     memcpy(decryptData, fragData, sizeof(decryptData));
-    CryptoCanAlgo_DecryptInitPacket((uint8_t *)decryptData, this->serial);
+    CryptoCanAlgo_DecryptInitPacket((uint8_t *)decryptData, &this->cryptInitKey);
     if(decryptData[0] == 0xdeadbeef) {
-      CryptoCanAlgo_SolveChallenge(decryptData[1], this->serial, this->cryptDeviceID, this->cryptAesKey, &this->cryptAesIV);
+      CryptoCanAlgo_SolveChallenge(decryptData[1], this->serial, this->cryptDeviceID, &this->cryptSessionKey);
       memset(decryptData, 0xa5, sizeof(decryptData));
       decryptData[0] = 0xdeadbeef;
       decryptData[1] = random_range(0, 0xFFFF);
-      CryptoCanAlgo_EncryptDataPacket((uint8_t *)decryptData, this->cryptAesKey, this->cryptAesIV);
+      CryptoCanAlgo_EncryptDataPacket((uint8_t *)decryptData, &this->cryptSessionKey);
       send_fragmented_message(FragCmd_CryptoChallengeReply, decryptData, sizeof(decryptData));
     }
     break;
   case FragCmd_CryptoChallengeReply:
     memcpy(decryptData, fragData, sizeof(decryptData));
-    CryptoCanAlgo_DecryptDataPacket((uint8_t *)decryptData, this->cryptAesKey, this->cryptAesIV);
+    CryptoCanAlgo_DecryptDataPacket((uint8_t *)decryptData, &this->cryptSessionKey);
     if(decryptData[0] == 0xdeadbeef) {
       memset(decryptData, 0xa5, sizeof(decryptData));
       decryptData[0] = 0xdeadbeef;
       decryptData[1] = random_range(0, 0xFFFF);
-      CryptoCanAlgo_EncryptDataPacket((uint8_t *)decryptData, this->cryptAesKey, this->cryptAesIV);
+      CryptoCanAlgo_EncryptDataPacket((uint8_t *)decryptData, &this->cryptSessionKey);
       send_fragmented_message(FragCmd_CryptoChallengeReply, decryptData, sizeof(decryptData));
     }
     break;
@@ -10,8 +10,12 @@
 
 #include "LoxExtension.hpp"
 
-#define EXTENSION_RS232 0
-#define EXTENSION_MODBUS 0
+// Static RAM of an enabled extension (object, buffers and task stack, summed from the type sizes)
+// out of the 64KB of the STM32F103VE: RS232 about 4KB, Modbus about 16KB. 6KB of the Modbus RAM
+// are its configuration: the fragment buffer, the active and the pending copy.
+#define EXTENSION_RS232 1
+#define EXTENSION_MODBUS 1
+#define EXTENSION_DMX 0
 
 /////////////////////////////////////////////////////////////////
 // Legacy protocol
@@ -49,6 +53,8 @@ typedef struct {
     uint16_t checksum; // byte checksum over the fragment
 } LoxFragHeader;
 
+#define LEGACY_FRAG_TIMEOUT_MS 500 // an incomplete fragment is dropped, if no package arrives for this time
+
 class LoxLegacyExtension : public LoxExtension {
 protected:
   bool isMuted;
@@ -60,14 +66,23 @@ protected:
   uint32_t firmwareNewVersion;
   uint32_t firmwareUpdateCRCs[64];
   LoxFragHeader fragHeader;
-  int fragLargeIndex;
+  uint32_t fragReceived[8];  // bitmap of the received packages (the first 256 packages)
+  uint16_t fragPackages;     // number of data packages of the fragment
+  uint16_t fragPackageCount; // number of different data packages received so far
+  uint16_t fragChecksum;     // byte checksum over the received data packages
+  uint8_t fragPackageSize;   // 6 bytes per package for normal, 7 bytes for large fragments
+  int16_t fragTimeout;       // in ms, 0 = no fragment in progress
   void *fragPtr;
   uint16_t fragMaxSize;
   uint8_t fragMinimalPackage[32];
 
   void sendCommandWithValues(LoxMsgLegacyCommand_t command, uint8_t val8, uint16_t val16, uint32_t val32);
   void sendCommandWithVersion(LoxMsgLegacyCommand_t command);
+  void sendStatistics(void);
   void send_fragmented_message(LoxMsgLegacyFragmentedCommand_t command, const void *buffer, uint32_t byteCount);
+  void send_fragmented_message(LoxMsgLegacyFragmentedCommand_t command, const void *buffer, uint32_t byteCount, const void *buffer2, uint32_t byteCount2);
+  void frag_start(const LoxFragHeader *header, int packageSize);
+  void frag_data(int index, const uint8_t *data);
 
   virtual void PacketMulticastAll(LoxCanMessage &message);
   virtual void PacketMulticastExtension(LoxCanMessage &message);
@@ -7,10 +7,10 @@
 
 #include "LoxLegacyModbusExtension.hpp"
 #if EXTENSION_MODBUS
+#include "Monitor.hpp"
 #include "global_functions.hpp"
 #include "stm32f1xx_hal.h"
-#include "stream_buffer.h"
-#include "task.h"
+#include <__cross_studio_io.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -23,10 +23,87 @@
 #define RS485_TX_ENABLE_Pin GPIO_PIN_5
 #define RS485_TX_ENABLE_GPIO_Port GPIOC
 
+#define MODBUS_SILENCE_FIXED_BAUDRATE 19200 // above this baudrate the silence is fixed to 1.75ms
+#define MODBUS_SILENCE_FIXED_US 1750
+
+typedef enum {
+  eModbusEvent_frameReceived = 0x01,
+  eModbusEvent_commandQueued = 0x02,  // a command from the Miniserver was added to the txQueue
+  eModbusEvent_configReceived = 0x04, // a new configuration is waiting in configPending
+} eModbusEvent;
+
 static UART_HandleTypeDef huart3;
-static uint8_t gModbusChar;
-static volatile uint8_t gModbus_RX_Buffer[Modbus_RX_BUFFERSIZE];
-static volatile int gModbus_RX_Buffer_count;
+static LoxLegacyModbusExtension *gModbusExtension;
+static CTL_EVENT_SET_t gModbusEvent; // eModbusEvent_frameReceived is set by TIM4 at the end of a frame, the others wake the Modbus task
+static uint8_t gModbus_RX_Ring[Modbus_RX_RING_SIZE]; // written by DMA1 channel 3
+static uint32_t gModbus_RX_Tail;                     // read position in the ring
+static volatile uint32_t gModbus_RX_IdleHead;        // ring position at the last idle line
+static volatile bool gModbus_RX_Error;               // parity/framing/noise/overrun error in the current frame
+static uint8_t gModbus_RX_Buffer[Modbus_RX_BUFFERSIZE];
+static int gModbus_RX_Buffer_count;
+
+/***
+ *  Value of one or two registers (in the byte order of the reply), converted by the device entry flags
+ ***/
+static uint32_t modbus_register_value(const uint8_t *data, uint32_t pollingCycle) {
+  if (pollingCycle & tModbusFlags_combineTwoRegs) { // two 16-bit registers = 32-bit value
+    uint32_t value = data[0] | (data[1] << 8) | (data[2] << 16) | (data[3] << 24);
+    if (pollingCycle & tModbusFlags_regOrderHighLow)
+      value = (value >> 16) | (value << 16);
+    if (pollingCycle & tModbusFlags_littleEndian)
+      value = ((value >> 8) & 0x00FF00FF) | ((value << 8) & 0xFF00FF00);
+    return value;
+  }
+  uint32_t value = data[0] | (data[1] << 8);
+  if (pollingCycle & tModbusFlags_littleEndian)
+    value = ((value >> 8) & 0x00FF) | ((value << 8) & 0xFF00);
+  return value;
+}
+
+// current write position of the DMA in the receive ring
+static inline uint32_t modbus_rx_head(void) {
+  return (Modbus_RX_RING_SIZE - DMA1_Channel3->CNDTR) & (Modbus_RX_RING_SIZE - 1);
+}
+
+/***
+ *  Setup the USART3 pins, the RS485 direction pins and the interrupt. Done here and not in
+ *  HAL_UART_MspInit(), because several extensions with different UARTs can run on one board.
+ ***/
+static void rs485_gpio_init(void) {
+  GPIO_InitTypeDef GPIO_InitStruct = {0};
+  __HAL_RCC_USART3_CLK_ENABLE();
+  __HAL_RCC_GPIOB_CLK_ENABLE();
+  __HAL_RCC_GPIOC_CLK_ENABLE();
+
+  // RX mode by default
+  HAL_GPIO_WritePin(RS485_RX_ENABLE_GPIO_Port, RS485_RX_ENABLE_Pin, GPIO_PIN_RESET);
+  HAL_GPIO_WritePin(RS485_TX_ENABLE_GPIO_Port, RS485_TX_ENABLE_Pin, GPIO_PIN_RESET);
+
+  GPIO_InitStruct.Pin = RS485_RX_ENABLE_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
+  HAL_GPIO_Init(RS485_RX_ENABLE_GPIO_Port, &GPIO_InitStruct);
+  GPIO_InitStruct.Pin = RS485_TX_ENABLE_Pin;
+  HAL_GPIO_Init(RS485_TX_ENABLE_GPIO_Port, &GPIO_InitStruct);
+
+  /**USART3 GPIO Configuration
+  PB10     ------> USART3_TX
+  PB11     ------> USART3_RX
+  */
+  GPIO_InitStruct.Pin = RS485_TX_PIN_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+  HAL_GPIO_Init(RS485_TX_PIN_GPIO_Port, &GPIO_InitStruct);
+
+  GPIO_InitStruct.Pin = RS485_RX_PIN_Pin;
+  GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  HAL_GPIO_Init(RS485_RX_PIN_GPIO_Port, &GPIO_InitStruct);
+
+  HAL_NVIC_SetPriority(USART3_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(USART3_IRQn);
+}
 
 /***
  *  Constructor
@@ -34,6 +111,10 @@ static volatile int gModbus_RX_Buffer_count;
 LoxLegacyModbusExtension::LoxLegacyModbusExtension(LoxCANBaseDriver &driver, uint32_t serial)
   : LoxLegacyExtension(driver, (serial & 0xFFFFFF) | (eDeviceType_t_ModbusExtension << 24), eDeviceType_t_ModbusExtension, 0, 10020326, &fragData, sizeof(fragData)) {
   assert(sizeof(sModbusConfig) == 0x810);
+  gModbusExtension = this;
+  memset(this->sensors, 0, sizeof(this->sensors));
+  memset(this->slaveIndex, 0, sizeof(this->slaveIndex));
+  this->slaveCount = 0;
 }
 
 /***
@@ -77,6 +158,10 @@ void LoxLegacyModbusExtension::rs485_setup(void) {
   }
   debug_printf("%ld\n", this->config.twoStopBits + 1);
   this->characterTime_us = 1000000 * (1 + this->config.wordLength + (this->config.parity != 0) + (this->config.twoStopBits ? 2 : 1)) / this->config.baudrate;
+  if (this->config.baudrate > MODBUS_SILENCE_FIXED_BAUDRATE)
+    this->silenceTime_us = MODBUS_SILENCE_FIXED_US;
+  else
+    this->silenceTime_us = this->characterTime_us * 35 / 10;
 
   // configure the UART
   HAL_StatusTypeDef status;
@@ -94,13 +179,83 @@ void LoxLegacyModbusExtension::rs485_setup(void) {
     debug_printf("### MODBUS HAL_UART_Init ERROR #%d\n", status);
 #endif
   }
-  // RXNE Interrupt Enable
-  SET_BIT(huart3.Instance->CR1, USART_CR1_RXNEIE);
+  rs485_dma_setup();
+}
+
+/***
+ *  Receive continuously via DMA into a ring buffer, transmit via DMA. The end of a frame is detected
+ *  by the idle line interrupt (1 character of silence), followed by a TIM4 one-shot for the rest of
+ *  the 3.5 characters of silence.
+ ***/
+void LoxLegacyModbusExtension::rs485_dma_setup(void) {
+  __HAL_RCC_DMA1_CLK_ENABLE();
+  __HAL_RCC_TIM4_CLK_ENABLE();
+
+  // DMA1 channel 3: USART3_RX => ring buffer
+  DMA1_Channel3->CCR = 0;
+  DMA1_Channel3->CPAR = (uint32_t)&USART3->DR;
+  DMA1_Channel3->CMAR = (uint32_t)gModbus_RX_Ring;
+  DMA1_Channel3->CNDTR = Modbus_RX_RING_SIZE;
+  DMA1_Channel3->CCR = DMA_CCR_PL_1 | DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_EN;
+  gModbus_RX_Tail = gModbus_RX_IdleHead = modbus_rx_head();
+
+  // DMA1 channel 2: buffer => USART3_TX, started by rs485_transmit()
+  DMA1_Channel2->CCR = 0;
+  DMA1_Channel2->CPAR = (uint32_t)&USART3->DR;
+  DMA1_Channel2->CCR = DMA_CCR_PL_0 | DMA_CCR_MINC | DMA_CCR_DIR;
+
+  SET_BIT(USART3->CR3, USART_CR3_DMAR | USART_CR3_DMAT | USART_CR3_EIE);
+  SET_BIT(USART3->CR1, USART_CR1_IDLEIE | USART_CR1_PEIE);
+
+  // TIM4: one-shot timer in us for the remaining silence after the idle line
+  uint32_t remaining_us = this->silenceTime_us > this->characterTime_us ? this->silenceTime_us - this->characterTime_us : 1;
+  TIM4->CR1 = 0;
+  TIM4->PSC = 2 * HAL_RCC_GetPCLK1Freq() / 1000000 - 1; // APB1 prescaler != 1 => timer clock is doubled
+  TIM4->ARR = remaining_us;
+  TIM4->CR1 = TIM_CR1_OPM | TIM_CR1_URS; // the update generation below does not trigger the interrupt
+  TIM4->EGR = TIM_EGR_UG;
+  TIM4->SR = 0;
+  TIM4->DIER = TIM_DIER_UIE;
+  HAL_NVIC_SetPriority(TIM4_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(TIM4_IRQn);
+}
+
+/***
+ *  Start the transmission of a buffer via DMA. The transmission complete interrupt
+ *  switches the RS485 back into RX mode after the last stop bit.
+ ***/
+void LoxLegacyModbusExtension::rs485_transmit(const uint8_t *buffer, size_t byteCount) {
+  // ignore everything received before this request
+  gModbus_RX_Tail = gModbus_RX_IdleHead = modbus_rx_head();
+  gModbus_RX_Error = false;
+  ctl_events_set_clear(&gModbusEvent, 0, eModbusEvent_frameReceived);
+
+  this->set_tx_mode(true);
+  DMA1_Channel2->CCR &= ~DMA_CCR_EN;
+  DMA1_Channel2->CMAR = (uint32_t)buffer;
+  DMA1_Channel2->CNDTR = byteCount;
+  CLEAR_BIT(USART3->SR, USART_SR_TC);
+  DMA1_Channel2->CCR |= DMA_CCR_EN;
+  SET_BIT(USART3->CR1, USART_CR1_TCIE);
+}
 
-  status = HAL_UART_Receive_IT(&huart3, &gModbusChar, 1);
-  if(status != HAL_OK) {
-    debug_printf("HAL_UART_Receive_IT error #%d\n", status);
+/***
+ *  Copy a received frame from the ring buffer. Returns the number of bytes,
+ *  0 if there was no reply within the timeout or -1 for a transmission error.
+ ***/
+int LoxLegacyModbusExtension::rs485_receive(uint8_t *buffer, size_t bufferSize, uint32_t timeout_ms) {
+  if (!ctl_events_wait(CTL_EVENT_WAIT_ANY_EVENTS_WITH_AUTO_CLEAR, &gModbusEvent, eModbusEvent_frameReceived, CTL_TIMEOUT_DELAY, timeout_ms))
+    return 0;
+  uint32_t head = gModbus_RX_IdleHead;
+  size_t count = 0;
+  while (gModbus_RX_Tail != head) {
+    if (count < bufferSize)
+      buffer[count++] = gModbus_RX_Ring[gModbus_RX_Tail];
+    gModbus_RX_Tail = (gModbus_RX_Tail + 1) & (Modbus_RX_RING_SIZE - 1);
   }
+  if (gModbus_RX_Error)
+    return -1;
+  return count;
 }
 
 /***
@@ -112,13 +267,11 @@ void LoxLegacyModbusExtension::config_load(void) {
     this->timeTimeout = this->config.timingTimeout;
   } else {
     // automatic mode
-    this->timePause = (1 + 8 + 1) * 1000 / this->config.baudrate * 35 / 10; // RS485 are using 10 bits per character, the delay is 3.5 times a character
-    this->timeTimeout = 1000;                                               // wait up to 1s for a reply
+    this->timePause = 0;      // the end of a reply is only detected after 3.5 characters of silence, no additional pause necessary
+    this->timeTimeout = 1000; // wait up to 1s for a reply
   }
-  // minimum time: 5ms, maximum 10s
-  if (this->timePause < 5)
-    this->timePause = 5;
-  else if (this->timePause > 10000)
+  // pause: maximum 10s, timeout: minimum time: 5ms, maximum 10s
+  if (this->timePause > 10000)
     this->timePause = 10000;
   if (this->timeTimeout < 5)
     this->timeTimeout = 5;
@@ -168,37 +321,179 @@ void LoxLegacyModbusExtension::config_load(void) {
     debug_printf(" %.1fs\n", cycle * 0.001);
   }
 
-  memset(this->deviceTimeout, 0, sizeof(this->deviceTimeout));
+  poll_schedule_init();
 
   HAL_UART_DeInit(&huart3);
   rs485_setup();
 }
 
+/***
+ *  State of a slave. Only the first Modbus_MAX_SLAVE_STATES addresses get one, which covers
+ *  typical installations without reserving the state for all 247 possible addresses.
+ ***/
+sModbusSlaveState *LoxLegacyModbusExtension::slave_state(uint8_t address, bool create) {
+  if (address >= Modbus_MAX_SLAVES)
+    return NULL;
+  if (this->slaveIndex[address] == 0) {
+    if (!create or this->slaveCount >= Modbus_MAX_SLAVE_STATES)
+      return NULL;
+    memset(&this->slaves[this->slaveCount], 0, sizeof(this->slaves[0]));
+    this->slaveIndex[address] = ++this->slaveCount;
+  }
+  return &this->slaves[this->slaveIndex[address] - 1];
+}
+
+const sModbusSlaveState *LoxLegacyModbusExtension::slave_state(uint8_t address) const {
+  if (address >= Modbus_MAX_SLAVES or this->slaveIndex[address] == 0)
+    return NULL;
+  return &this->slaves[this->slaveIndex[address] - 1];
+}
+
+/***
+ *  Reply timeout for a slave: the smoothed round trip time plus 4 times its variation (RFC 6298).
+ *  Without a measurement or with manual timing the configured timeout is used.
+ ***/
+uint32_t LoxLegacyModbusExtension::slave_timeout_ms(uint8_t address, uint32_t txTime_ms) const {
+  const sModbusSlaveState *s = slave_state(address);
+  if (s == NULL or this->config.manualTimingFlag or s->srtt == 0)
+    return txTime_ms + this->timeTimeout;
+  uint32_t timeout = (s->srtt >> 3) + s->rttvar; // the round trip time already includes the transmission
+  if (timeout < txTime_ms + Modbus_MIN_TIMEOUT_MS)
+    timeout = txTime_ms + Modbus_MIN_TIMEOUT_MS;
+  if (timeout > txTime_ms + this->timeTimeout)
+    timeout = txTime_ms + this->timeTimeout;
+  return timeout;
+}
+
+/***
+ *  A slave replied. rtt_ms is the time from the start of the transmission to the end of the reply, 0 = unknown
+ ***/
+void LoxLegacyModbusExtension::slave_reply(uint8_t address, uint32_t rtt_ms) {
+  sModbusSlaveState *s = slave_state(address, true);
+  if (s == NULL)
+    return;
+  if (s->replyCount < 0xFFFF)
+    ++s->replyCount;
+  s->failures = 0;
+  s->backoffShift = 0;
+  if (rtt_ms == 0)
+    return;
+  if (rtt_ms > 0x1FFF) // keep the fixed-point values in 16 bits
+    rtt_ms = 0x1FFF;
+  if (s->srtt == 0) {
+    s->srtt = rtt_ms << 3;
+    s->rttvar = rtt_ms << 1; // rtt / 2
+  } else {
+    int32_t delta = int32_t(rtt_ms) - (s->srtt >> 3);
+    s->srtt += delta; // srtt = 7/8 srtt + 1/8 rtt
+    if (delta < 0)
+      delta = -delta;
+    s->rttvar += delta - (s->rttvar >> 2); // rttvar = 3/4 rttvar + 1/4 |delta|
+  }
+}
+
+/***
+ *  A slave did not reply. After several failures it is only probed with an exponential backoff,
+ *  so an offline slave does not block the bus for the others.
+ ***/
+void LoxLegacyModbusExtension::slave_no_reply(uint8_t address) {
+  sModbusSlaveState *s = slave_state(address, true);
+  if (s == NULL)
+    return;
+  if (s->noReplyCount < 0xFFFF)
+    ++s->noReplyCount;
+  if (s->failures < 0xFF)
+    ++s->failures;
+  if (s->failures >= Modbus_BACKOFF_FAILURES) {
+    uint32_t backoff = Modbus_BACKOFF_MIN_MS << s->backoffShift;
+    if (backoff >= Modbus_BACKOFF_MAX_MS)
+      backoff = Modbus_BACKOFF_MAX_MS;
+    else
+      ++s->backoffShift;
+    s->backoffUntil = ctl_get_current_time() + backoff;
+  }
+}
+
+/***
+ *  Should a slave be polled? Offline slaves are only probed, when their backoff expired.
+ ***/
+bool LoxLegacyModbusExtension::slave_available(uint8_t address) const {
+  const sModbusSlaveState *s = slave_state(address);
+  if (s == NULL)
+    return true;
+  return s->failures < Modbus_BACKOFF_FAILURES or int32_t(ctl_get_current_time() - s->backoffUntil) >= 0;
+}
+
+/***
+ *  Per slave statistics, requested by the Miniserver via the debug command:
+ *  value8 = slave address, value16 = tModbusError_SlaveStatistics | reply timeout in ms,
+ *  value32 = requests without reply << 16 | requests with reply
+ ***/
+void LoxLegacyModbusExtension::send_slave_statistics(void) {
+  for (int address = 1; address < Modbus_MAX_SLAVES; ++address) {
+    const sModbusSlaveState *s = slave_state(address);
+    if (s == NULL or (s->replyCount == 0 and s->noReplyCount == 0))
+      continue;
+    debug_printf("Modbus slave %d: srtt:%dms rttvar:%dms replies:%d no replies:%d%s\n", address, s->srtt >> 3, s->rttvar >> 2, s->replyCount, s->noReplyCount, slave_available(address) ? "" : " offline");
+    uint32_t timeout = slave_timeout_ms(address, 0);
+    if (timeout >= tModbusError_SlaveStatistics)
+      timeout = tModbusError_SlaveStatistics - 1;
+    sendCommandWithValues(debug, address, tModbusError_SlaveStatistics | timeout, (s->noReplyCount << 16) | s->replyCount);
+  }
+}
+
+/***
+ *  Send all sensor values again after the next poll
+ ***/
+void LoxLegacyModbusExtension::sensor_invalidate(void) {
+  CTL_TIME_t now = ctl_get_current_time();
+  for (int i = 0; i < Modbus_MAX_DEVICES; ++i)
+    this->sensors[i].time = now - Modbus_REFRESH_MS;
+}
+
+/***
+ *  Forward a polled value to the Miniserver, if it changed or the refresh is due
+ ***/
+void LoxLegacyModbusExtension::send_sensor_value(int devIndex, uint32_t value) {
+  CTL_TIME_t now = ctl_get_current_time();
+  sModbusSensorCache *sc = &this->sensors[devIndex];
+  if (int32_t(now - sc->time) < int32_t(Modbus_REFRESH_MS)) {
+    if (value == sc->value)
+      return;
+  }
+  sc->value = value;
+  sc->time = now;
+  sendCommandWithValues(Modbus_485_SensorValue, devIndex, 0, value);
+}
+
 /***
  *  Transmit buffer via RS485 and wait for reply
  ***/
-bool LoxLegacyModbusExtension::_transmitBuffer(int devIndex, const uint8_t *txBuffer, size_t txBufferCount) {
+bool LoxLegacyModbusExtension::_transmitBuffer(int devIndex, const uint8_t *txBuffer, size_t txBufferCount, const sModbusPollGroup *group) {
   debug_print_buffer((void *)txBuffer, txBufferCount, "### TX DATA:");
   gModbus_RX_Buffer_count = 0; // reset the RX buffer for our transmission
-  this->set_tx_mode(true);
-  HAL_StatusTypeDef status = HAL_UART_Transmit(&huart3, (uint8_t *)txBuffer, txBufferCount, 2 * txBufferCount * this->characterTime_us / 1000); // timeout is twice the time it takes to transmit
-  if (status != HAL_OK) {
-#if DEBUG
-    debug_printf("### HAL_UART_Transmit error #%d\n", status);
-#endif
+  rs485_transmit(txBuffer, txBufferCount);
+  const uint32_t txTime_ms = (txBufferCount * this->characterTime_us + this->silenceTime_us) / 1000 + 1;
+  if (txBuffer[0] == 0) { // broadcast => no reply
+    ctl_timeout_wait(ctl_get_current_time() + txTime_ms);
+    return true;
   }
-  vTaskDelay(pdMS_TO_TICKS(1));
-  this->set_tx_mode(false);
-  for (uint32_t i = 0; i < this->timeTimeout; i += 100) {
-    vTaskDelay(pdMS_TO_TICKS(100));
-    if (gModbus_RX_Buffer_count)
-      break;
-  }
-  debug_print_buffer((void *)gModbus_RX_Buffer, gModbus_RX_Buffer_count, "### RX DATA:");
-  if (!gModbus_RX_Buffer_count) {
+  const uint8_t address = txBuffer[0];
+  const CTL_TIME_t txStart = ctl_get_current_time();
+  int rxCount = rs485_receive(gModbus_RX_Buffer, sizeof(gModbus_RX_Buffer), slave_timeout_ms(address, txTime_ms));
+  if (rxCount == 0) {
+    slave_no_reply(address);
     debug_printf("tModbusError_NoResponse\n");
     return false;
   }
+  const uint32_t rtt_ms = ctl_get_current_time() - txStart + 1; // round up, 0 is reserved for unknown
+  slave_reply(address, rxCount > 0 ? rtt_ms : 0);
+  if (rxCount < 0) {
+    debug_printf("tModbusError_CRC_Error\n"); // parity/framing error
+    return false;
+  }
+  gModbus_RX_Buffer_count = rxCount;
+  debug_print_buffer((void *)gModbus_RX_Buffer, gModbus_RX_Buffer_count, "### RX DATA:");
   if (gModbus_RX_Buffer_count <= 4) {
     debug_printf("tModbusError_InvalidReceiveLength\n");
     return false;
@@ -226,31 +521,28 @@ bool LoxLegacyModbusExtension::_transmitBuffer(int devIndex, const uint8_t *txBu
   case tModbusCode_ReadDiscreteInputs:
     if (count < 1) {
       value = gModbus_RX_Buffer[3];
-      sendCommandWithValues(Modbus_485_SensorValue, devIndex, 0, value);
+      send_sensor_value(devIndex, value);
     } else {
       sendCommandWithValues(debug, gModbus_RX_Buffer[1], tModbusError_InvalidReceiveLength, value);
     }
     break;
   case tModbusCode_ReadHoldingRegisters:
   case tModbusCode_ReadInputRegister:
-    if (dc->pollingCycle & tModbusFlags_combineTwoRegs) { // two 16-bit registers = 32-bit value
-      if (count <= 4) {
-        if (dc->pollingCycle & tModbusFlags_regOrderHighLow)
-          value = (value >> 16) | (value << 16);
-        if (dc->pollingCycle & tModbusFlags_littleEndian)
-          value = ((value >> 8) & 0x00FF00FF) | ((value << 8) & 0xFF00FF00);
-        sendCommandWithValues(Modbus_485_SensorValue, devIndex, 0, value);
-      } else {
+    if (group) { // split the reply into the values of the group members
+      if (count != 2 * group->regCount or gModbus_RX_Buffer[2] != count) {
         sendCommandWithValues(debug, gModbus_RX_Buffer[1], tModbusError_InvalidReceiveLength, value);
+        break;
       }
-    } else {
-      if (count <= 2) {
-        if (dc->pollingCycle & tModbusFlags_littleEndian)
-          value = ((value >> 8) & 0x00FF) | ((value << 8) & 0xFF00);
-        sendCommandWithValues(Modbus_485_SensorValue, devIndex, 0, value);
-      } else {
-        sendCommandWithValues(debug, gModbus_RX_Buffer[1], tModbusError_InvalidReceiveLength, value);
+      for (int m = 0; m < group->memberCount; ++m) {
+        int memberIndex = this->pollMembers[group->firstMember + m];
+        const sModbusDeviceConfig *mc = &this->config.devices[memberIndex];
+        const uint8_t *data = &gModbus_RX_Buffer[3 + 2 * (mc->regNumber - group->firstReg)];
+        send_sensor_value(memberIndex, modbus_register_value(data, mc->pollingCycle));
       }
+    } else if (count <= ((dc->pollingCycle & tModbusFlags_combineTwoRegs) ? 4 : 2)) {
+      send_sensor_value(devIndex, modbus_register_value(&gModbus_RX_Buffer[3], dc->pollingCycle));
+    } else {
+      sendCommandWithValues(debug, gModbus_RX_Buffer[1], tModbusError_InvalidReceiveLength, value);
     }
     break;
   case tModbusCode_WriteSingleCoil:
@@ -269,71 +561,286 @@ bool LoxLegacyModbusExtension::_transmitBuffer(int devIndex, const uint8_t *txBu
   return true;
 }
 
-bool LoxLegacyModbusExtension::transmitBuffer(int devIndex, const uint8_t *txBuffer, size_t txBufferCount) {
-  bool result = _transmitBuffer(devIndex, txBuffer, txBufferCount);
-  vTaskDelay(pdMS_TO_TICKS(this->timePause)); // a little pause after a transmission
+bool LoxLegacyModbusExtension::transmitBuffer(int devIndex, const uint8_t *txBuffer, size_t txBufferCount, const sModbusPollGroup *group) {
+  bool result = _transmitBuffer(devIndex, txBuffer, txBufferCount, group);
+  if (this->timePause)
+    ctl_timeout_wait(ctl_get_current_time() + this->timePause); // a little pause after a transmission
   gModbus_RX_Buffer_count = 0;                // reset the RX buffer for our transmission
   return result;
 }
 
 /***
- *  Modbus TX Task
+ *  Polling cycle of a device entry in ms
+ ***/
+uint32_t LoxLegacyModbusExtension::poll_cycle_ms(const sModbusDeviceConfig *dc) const {
+  uint32_t pollingCycle = dc->pollingCycle;
+  uint32_t ticks = (pollingCycle & 0xFFF) * 100; // default unit: ticks in 100ms
+  if (pollingCycle & tModbusFlags_1000ms)        // value too large for it? Then the ticks are in seconds
+    ticks *= 10;
+  //if (ticks < 5000)
+  //  ticks = 5000; // Loxone throttles the requests to 5s
+  return ticks;
+}
+
+/***
+ *  Number of registers read by a device entry, 0 if it can not be merged with others
+ ***/
+uint16_t LoxLegacyModbusExtension::poll_reg_count(const sModbusDeviceConfig *dc) const {
+  switch (dc->functionCode & 0x1F) {
+  case tModbusCode_ReadHoldingRegisters:
+  case tModbusCode_ReadInputRegister:
+    return (dc->pollingCycle & tModbusFlags_combineTwoRegs) ? 2 : 1;
+  default:
+    return 0;
+  }
+}
+
+/***
+ *  Sort order of the device entries: slave address, function code, polling cycle, register
+ ***/
+bool LoxLegacyModbusExtension::poll_member_before(int a, int b) const {
+  const sModbusDeviceConfig *da = &this->config.devices[a];
+  const sModbusDeviceConfig *db = &this->config.devices[b];
+  if (da->address != db->address)
+    return da->address < db->address;
+  if ((da->functionCode & 0x1F) != (db->functionCode & 0x1F))
+    return (da->functionCode & 0x1F) < (db->functionCode & 0x1F);
+  if (poll_cycle_ms(da) != poll_cycle_ms(db))
+    return poll_cycle_ms(da) < poll_cycle_ms(db);
+  return da->regNumber < db->regNumber;
+}
+
+/***
+ *  Can a device entry be added to the end of a group?
+ ***/
+bool LoxLegacyModbusExtension::poll_can_merge(const sModbusPollGroup *group, int devIndex) const {
+  const sModbusDeviceConfig *first = &this->config.devices[this->pollMembers[group->firstMember]];
+  const sModbusDeviceConfig *dc = &this->config.devices[devIndex];
+  uint16_t regCount = poll_reg_count(dc);
+  if (regCount == 0 or poll_reg_count(first) == 0)
+    return false;
+  if (dc->address != first->address or (dc->functionCode & 0x1F) != (first->functionCode & 0x1F) or poll_cycle_ms(dc) != poll_cycle_ms(first))
+    return false;
+  if (dc->regNumber > group->firstReg + group->regCount + Modbus_GROUP_MAX_GAP)
+    return false;
+  uint32_t end = dc->regNumber + regCount;
+  return end - group->firstReg <= Modbus_GROUP_MAX_REGS;
+}
+
+/***
+ *  Merge device entries with consecutive registers into groups, which are polled with one request
+ ***/
+void LoxLegacyModbusExtension::poll_build_groups(void) {
+  int entryCount = this->config.entryCount <= Modbus_MAX_DEVICES ? this->config.entryCount : Modbus_MAX_DEVICES;
+  // insertion sort, only done after a configuration change
+  for (int i = 0; i < entryCount; ++i) {
+    int j = i;
+    for (; j > 0 and poll_member_before(i, this->pollMembers[j - 1]); --j)
+      this->pollMembers[j] = this->pollMembers[j - 1];
+    this->pollMembers[j] = i;
+  }
+  this->pollGroupCount = 0;
+  for (int i = 0; i < entryCount; ++i) {
+    int devIndex = this->pollMembers[i];
+    const sModbusDeviceConfig *dc = &this->config.devices[devIndex];
+    sModbusPollGroup *group = this->pollGroupCount > 0 ? &this->pollGroups[this->pollGroupCount - 1] : NULL;
+    if (group and poll_can_merge(group, devIndex)) {
+      uint32_t end = dc->regNumber + poll_reg_count(dc);
+      if (end > group->firstReg + group->regCount)
+        group->regCount = end - group->firstReg;
+      ++group->memberCount;
+      continue;
+    }
+    group = &this->pollGroups[this->pollGroupCount++];
+    group->firstReg = dc->regNumber;
+    group->regCount = poll_reg_count(dc);
+    group->firstMember = i;
+    group->memberCount = 1;
+  }
+  debug_printf("Modbus: %d device entries polled with %d requests\n", entryCount, this->pollGroupCount);
+}
+
+/***
+ *  Earliest deadline first, the tick counter is allowed to wrap around
+ ***/
+bool LoxLegacyModbusExtension::poll_due_before(int a, int b) const {
+  return int32_t(this->pollDue[this->pollHeap[a]] - this->pollDue[this->pollHeap[b]]) < 0;
+}
+
+/***
+ *  All groups are due right away. Identical deadlines are a valid heap.
+ ***/
+void LoxLegacyModbusExtension::poll_schedule_init(void) {
+  CTL_TIME_t now = ctl_get_current_time();
+  poll_build_groups();
+  this->pollHeapCount = this->pollGroupCount;
+  for (int i = 0; i < this->pollHeapCount; ++i) {
+    this->pollHeap[i] = i;
+    this->pollDue[i] = now;
+    this->pollOverrun[i] = false;
+  }
+  sensor_invalidate();
+  this->pollOverrunCount = 0;
+  memset(this->slaveIndex, 0, sizeof(this->slaveIndex));
+  this->slaveCount = 0;
+}
+
+/***
+ *  Returns the group with the earliest deadline, if it is due. Its next deadline
+ *  is scheduled right away. Otherwise -1 is returned and wait is set to the time until
+ *  the next deadline.
+ ***/
+int LoxLegacyModbusExtension::poll_next_due(CTL_TIME_t &wait) {
+  if (this->pollHeapCount == 0) {
+    wait = Modbus_IDLE_WAIT_MS;
+    return -1;
+  }
+  CTL_TIME_t now = ctl_get_current_time();
+  int groupIndex = this->pollHeap[0];
+  int32_t late = int32_t(now - this->pollDue[groupIndex]);
+  if (late < 0) {
+    wait = -late < Modbus_IDLE_WAIT_MS ? -late : Modbus_IDLE_WAIT_MS;
+    return -1;
+  }
+  // keep the phase of the polling cycle, unless a complete cycle was missed
+  const sModbusDeviceConfig *dc = &this->config.devices[this->pollMembers[this->pollGroups[groupIndex].firstMember]];
+  CTL_TIME_t cycle = poll_cycle_ms(dc);
+  bool overrun = cycle and late >= int32_t(cycle);
+  if (overrun or cycle == 0)
+    this->pollDue[groupIndex] = now + cycle;
+  else
+    this->pollDue[groupIndex] += cycle;
+  // sift the new deadline down the heap
+  int i = 0;
+  while (true) {
+    int child = 2 * i + 1;
+    if (child >= this->pollHeapCount)
+      break;
+    if (child + 1 < this->pollHeapCount and poll_due_before(child + 1, child))
+      ++child;
+    if (!poll_due_before(child, i))
+      break;
+    uint8_t tmp = this->pollHeap[i];
+    this->pollHeap[i] = this->pollHeap[child];
+    this->pollHeap[child] = tmp;
+    i = child;
+  }
+  bool reportOverrun = overrun and !this->pollOverrun[groupIndex];
+  this->pollOverrun[groupIndex] = overrun;
+  if (overrun)
+    ++this->pollOverrunCount;
+  if (reportOverrun) { // the configured polling cycles are more than the bus can handle
+    debug_printf("Modbus polling overrun: group #%d is %dms late\n", groupIndex, late);
+    sendCommandWithValues(debug, dc->functionCode, tModbusError_PollOverrun, this->pollMembers[this->pollGroups[groupIndex].firstMember]);
+  }
+  return groupIndex;
+}
+
+/***
+ *  Request the value of a device entry
+ ***/
+void LoxLegacyModbusExtension::poll_device(int devIndex, uint8_t *txBuffer) {
+  const sModbusDeviceConfig *dc = &this->config.devices[devIndex];
+  if (!slave_available(dc->address)) // offline slave, wait for the next probe
+    return;
+  size_t txBufferCount = 0;
+  txBuffer[txBufferCount++] = dc->address; // Modbus address
+  txBuffer[txBufferCount++] = dc->functionCode & 0x1F;
+  txBuffer[txBufferCount++] = dc->regNumber >> 8;
+  txBuffer[txBufferCount++] = dc->regNumber & 0xFF;
+  switch (dc->functionCode & 0x1F) {
+  case tModbusCode_ReadCoils:
+  case tModbusCode_ReadDiscreteInputs:
+    txBuffer[txBufferCount++] = 0;
+    txBuffer[txBufferCount++] = 1;
+    break;
+  case tModbusCode_ReadHoldingRegisters:
+  case tModbusCode_ReadInputRegister:
+    txBuffer[txBufferCount++] = 0;
+    txBuffer[txBufferCount++] = (dc->pollingCycle & tModbusFlags_combineTwoRegs) ? 2 : 1; // combine two registers?
+    break;
+  }
+  uint16_t crc = crc16_Modus(txBuffer, txBufferCount);
+  txBuffer[txBufferCount++] = crc & 0xFF;
+  txBuffer[txBufferCount++] = crc >> 8;
+  if (!transmitBuffer(devIndex, txBuffer, txBufferCount) and slave_available(dc->address)) {
+    // give it a second try, if the first transmission failed
+    transmitBuffer(devIndex, txBuffer, txBufferCount);
+  }
+}
+
+/***
+ *  Request the values of all device entries of a group with one request
+ ***/
+void LoxLegacyModbusExtension::poll_group(int groupIndex, uint8_t *txBuffer) {
+  const sModbusPollGroup *group = &this->pollGroups[groupIndex];
+  int devIndex = this->pollMembers[group->firstMember];
+  if (group->memberCount == 1) {
+    poll_device(devIndex, txBuffer);
+    return;
+  }
+  const sModbusDeviceConfig *dc = &this->config.devices[devIndex];
+  if (!slave_available(dc->address)) // offline slave, wait for the next probe
+    return;
+  size_t txBufferCount = 0;
+  txBuffer[txBufferCount++] = dc->address; // Modbus address
+  txBuffer[txBufferCount++] = dc->functionCode & 0x1F;
+  txBuffer[txBufferCount++] = group->firstReg >> 8;
+  txBuffer[txBufferCount++] = group->firstReg & 0xFF;
+  txBuffer[txBufferCount++] = group->regCount >> 8;
+  txBuffer[txBufferCount++] = group->regCount & 0xFF;
+  uint16_t crc = crc16_Modus(txBuffer, txBufferCount);
+  txBuffer[txBufferCount++] = crc & 0xFF;
+  txBuffer[txBufferCount++] = crc >> 8;
+  if (!transmitBuffer(devIndex, txBuffer, txBufferCount, group) and slave_available(dc->address)) {
+    // give it a second try, if the first transmission failed
+    transmitBuffer(devIndex, txBuffer, txBufferCount, group);
+  }
+}
+
+/***
+ *  Forward a Modbus command coming from the Miniserver, if there is one
+ ***/
+bool LoxLegacyModbusExtension::forward_command(uint8_t *txBuffer) {
+  uint8_t txBufferCount;
+  if (!ctl_byte_queue_receive_nb(&this->txQueue, &txBufferCount))
+    return false;
+  ctl_byte_queue_receive_multi(&this->txQueue, txBufferCount, txBuffer, CTL_TIMEOUT_INFINITE, 0); // the command is posted completely at once
+
+  if (!transmitBuffer(0, txBuffer, txBufferCount)) {
+    // give it a second try, if the first transmission failed
+    transmitBuffer(0, txBuffer, txBufferCount);
+  }
+  return true;
+}
+
+/***
+ *  Modbus TX Task: commands from the Miniserver have priority, otherwise the
+ *  device entries are polled earliest deadline first. A new configuration is
+ *  loaded between two transmissions.
  ***/
 void LoxLegacyModbusExtension::vModbusTXTask(void *pvParameters) {
   LoxLegacyModbusExtension *_this = (LoxLegacyModbusExtension *)pvParameters;
   static uint8_t txBuffer[32]; // static to avoid stack usage
+  unsigned events = 0;
   while (1) {
-    // poll devices
-    for (int devIndex = 0; devIndex < _this->config.entryCount; ++devIndex) {
-      const sModbusDeviceConfig *dc = &_this->config.devices[devIndex];
-      if (HAL_GetTick() >= _this->deviceTimeout[devIndex]) {
-        uint32_t pollingCycle = dc->pollingCycle;
-        uint32_t ticks = (pollingCycle & 0xFFF) * 100; // default unit: ticks in 100ms
-        if (pollingCycle & tModbusFlags_1000ms)        // value too large for it? Then the ticks are in seconds
-          ticks *= 10;
-        //if (ticks < 5000)
-        //  ticks = 5000; // Loxone throttles the requests to 5s
-        _this->deviceTimeout[devIndex] = HAL_GetTick() + pdMS_TO_TICKS(ticks);
-        size_t txBufferCount = 0;
-        txBuffer[txBufferCount++] = dc->address; // Modbus address
-        txBuffer[txBufferCount++] = dc->functionCode & 0x1F;
-        txBuffer[txBufferCount++] = dc->regNumber >> 8;
-        txBuffer[txBufferCount++] = dc->regNumber & 0xFF;
-        switch (dc->functionCode & 0x1F) {
-        case tModbusCode_ReadCoils:
-        case tModbusCode_ReadDiscreteInputs:
-          txBuffer[txBufferCount++] = 0;
-          txBuffer[txBufferCount++] = 1;
-          break;
-        case tModbusCode_ReadHoldingRegisters:
-        case tModbusCode_ReadInputRegister:
-          txBuffer[txBufferCount++] = 0;
-          txBuffer[txBufferCount++] = (pollingCycle & tModbusFlags_combineTwoRegs) ? 2 : 1; // combine two registers?
-          break;
-        }
-        uint16_t crc = crc16_Modus(txBuffer, txBufferCount);
-        txBuffer[txBufferCount++] = crc & 0xFF;
-        txBuffer[txBufferCount++] = crc >> 8;
-        if (!_this->transmitBuffer(devIndex, txBuffer, txBufferCount)) {
-          // give it a second try, if the first transmission failed
-          _this->transmitBuffer(devIndex, txBuffer, txBufferCount);
-        }
-      }
+    events |= ctl_events_wait(CTL_EVENT_WAIT_ANY_EVENTS_WITH_AUTO_CLEAR, &gModbusEvent, eModbusEvent_configReceived, CTL_TIMEOUT_NOW, 0);
+    if (events & eModbusEvent_configReceived) {
+      ctl_mutex_lock(&_this->configMutex, CTL_TIMEOUT_NONE, 0);
+      memcpy(&_this->config, &_this->configPending, sizeof(_this->config));
+      ctl_mutex_unlock(&_this->configMutex);
+      _this->config_load();
     }
-    // forward a Modbus command coming from the Miniserver
-    uint8_t txBufferCount;
-    while (xQueueReceive(&_this->txQueue, &txBufferCount, 10)) {
-      for (int i = 0; i < txBufferCount; ++i) {
-        uint8_t byte;
-        while (!xQueueReceive(&_this->txQueue, &byte, 1)) {
-        }
-        txBuffer[i] = byte;
-      }
-      if (!_this->transmitBuffer(0, txBuffer, txBufferCount)) {
-        // give it a second try, if the first transmission failed
-        _this->transmitBuffer(0, txBuffer, txBufferCount);
-      }
+    events = 0;
+    if (_this->forward_command(txBuffer))
+      continue;
+    CTL_TIME_t wait;
+    int groupIndex = _this->poll_next_due(wait);
+    if (groupIndex < 0) { // sleep until the next deadline, a Miniserver command or a new configuration
+      events = ctl_events_wait(CTL_EVENT_WAIT_ANY_EVENTS_WITH_AUTO_CLEAR, &gModbusEvent, eModbusEvent_commandQueued | eModbusEvent_configReceived, CTL_TIMEOUT_DELAY, wait);
+      continue;
     }
+    _this->poll_group(groupIndex, txBuffer);
   }
 }
 
@@ -341,15 +848,11 @@ void LoxLegacyModbusExtension::vModbusTXTask(void *pvParameters) {
  *  Setup GPIOs
  ***/
 void LoxLegacyModbusExtension::Startup(void) {
-  __HAL_RCC_USART3_CLK_ENABLE();
-  __HAL_RCC_GPIOB_CLK_ENABLE();
-
   static uint8_t sModbusTXBuffer[Modbus_TX_BUFFERSIZE];
-  xQueueCreateStatic(Modbus_TX_BUFFERSIZE, 1, sModbusTXBuffer, &this->txQueue);
-
-  static StackType_t sModbusTXTaskStack[configMINIMAL_STACK_SIZE];
-  static StaticTask_t sModbusTXTask;
-  xTaskCreateStatic(LoxLegacyModbusExtension::vModbusTXTask, "ModbusTXTask", configMINIMAL_STACK_SIZE, this, 2, sModbusTXTaskStack, &sModbusTXTask);
+  ctl_byte_queue_init(&this->txQueue, sModbusTXBuffer, Modbus_TX_BUFFERSIZE);
+  ctl_events_init(&gModbusEvent, 0);
+  ctl_mutex_init(&this->configMutex);
+  rs485_gpio_init();
 
   this->config.manualTimingFlag = false;
   this->config.baudrate = 9600;
@@ -357,7 +860,11 @@ void LoxLegacyModbusExtension::Startup(void) {
   this->config.twoStopBits = 0; // 1 stop bit
   this->config.parity = 0;      // no parity
   this->config.entryCount = 0;  // no devices
-  rs485_setup();
+  config_load();
+
+  static unsigned sModbusTaskStack[1 + Modbus_TASK_STACKSIZE + 1];
+  static CTL_TASK_t sModbusTask;
+  monitor_task_run(&sModbusTask, 0x08, LoxLegacyModbusExtension::vModbusTXTask, this, "Modbus", Modbus_TASK_STACKSIZE, sModbusTaskStack);
 }
 
 /***
@@ -365,6 +872,9 @@ void LoxLegacyModbusExtension::Startup(void) {
  ***/
 void LoxLegacyModbusExtension::PacketToExtension(LoxCanMessage &message) {
   switch (message.commandLegacy) {
+  case debug:
+    send_slave_statistics();
+    break;
   case Modbus_485_WriteSingleCoil:
   case Modbus_485_WriteSingleRegister:
   case Modbus_485_WriteMultipleRegisters:
@@ -421,11 +931,13 @@ void LoxLegacyModbusExtension::PacketToExtension(LoxCanMessage &message) {
     txBuffer[txBufferCount++] = crc & 0xFF;
     txBuffer[txBufferCount++] = crc >> 8;
     // send Modbus command comming from the Miniserver
-    uint8_t size = txBufferCount;
-    xQueueSendToBack(&this->txQueue, &size, 0);
-    for (int i = 0; i < txBufferCount; ++i) {
-      xQueueSendToBack(&this->txQueue, &txBuffer[i], 0);
+    if (ctl_byte_queue_num_free(&this->txQueue) < 1 + txBufferCount) { // only queue complete commands
+      sendCommandWithValues(debug, txBuffer[1], tModbusError_TxQueueOverrun, 0);
+      break;
     }
+    ctl_byte_queue_post_nb(&this->txQueue, txBufferCount);
+    ctl_byte_queue_post_multi_nb(&this->txQueue, txBufferCount, txBuffer);
+    ctl_events_set_clear(&gModbusEvent, eModbusEvent_commandQueued, 0);
     break;
   }
   default:
@@ -442,8 +954,12 @@ void LoxLegacyModbusExtension::FragmentedPacketToExtension(LoxMsgLegacyFragmente
   case FragCmd_config: {
     const sModbusConfig *configFragData = (const sModbusConfig *)fragData;
     if (size <= sizeof(sModbusConfig) and configFragData->version == 1) { // valid config?
-      memcpy(config, fragData, sizeof(config));
-      config_load();
+      // copy it, because fragData is overwritten by the next fragmented package
+      ctl_mutex_lock(&this->configMutex, CTL_TIMEOUT_NONE, 0);
+      memset(&this->configPending, 0, sizeof(this->configPending));
+      memcpy(&this->configPending, configFragData, size);
+      ctl_mutex_unlock(&this->configMutex);
+      ctl_events_set_clear(&gModbusEvent, eModbusEvent_configReceived, 0);
     }
     break;
   }
@@ -457,113 +973,41 @@ void LoxLegacyModbusExtension::FragmentedPacketToExtension(LoxMsgLegacyFragmente
  *  After a start request some extensions have to send additional messages
  ***/
 void LoxLegacyModbusExtension::StartRequest() {
+  sensor_invalidate(); // send all values again after the next poll
   sendCommandWithValues(config_check_CRC, 0, 1 /* config version */, 0); // required, otherwise it is considered offline
 }
 
-/**
-* @brief UART MSP Initialization
-* This function configures the hardware resources used in this example
-* @param huart: UART handle pointer
-* @retval None
-*/
-extern "C" void HAL_UART_MspInit(UART_HandleTypeDef *huart) {
-  GPIO_InitTypeDef GPIO_InitStruct = {0};
-  if (huart->Instance == USART3) {
-    /* Peripheral clock enable */
-    __HAL_RCC_USART3_CLK_ENABLE();
-
-    /* GPIO Ports Clock Enable */
-    __HAL_RCC_GPIOB_CLK_ENABLE();
-    __HAL_RCC_GPIOC_CLK_ENABLE();
-
-    /*Configure GPIO pin Output Level */
-    HAL_GPIO_WritePin(RS485_RX_ENABLE_GPIO_Port, RS485_RX_ENABLE_Pin, GPIO_PIN_RESET);
-    HAL_GPIO_WritePin(RS485_TX_ENABLE_GPIO_Port, RS485_TX_ENABLE_Pin, GPIO_PIN_RESET);
-
-    /*Configure GPIO pins : PCPin PCPin */
-    GPIO_InitStruct.Pin = RS485_RX_ENABLE_Pin;
-    GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
-    GPIO_InitStruct.Pull = GPIO_NOPULL;
-    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
-    HAL_GPIO_Init(RS485_RX_ENABLE_GPIO_Port, &GPIO_InitStruct);
-    GPIO_InitStruct.Pin = RS485_TX_ENABLE_Pin;
-    GPIO_InitStruct.Mode = GPIO_MODE_OUTPUT_PP;
-    GPIO_InitStruct.Pull = GPIO_NOPULL;
-    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_LOW;
-    HAL_GPIO_Init(RS485_TX_ENABLE_GPIO_Port, &GPIO_InitStruct);
-
-    /**USART3 GPIO Configuration    
-    PB10     ------> USART3_TX
-    PB11     ------> USART3_RX 
-    */
-    GPIO_InitStruct.Pin = RS485_TX_PIN_Pin;
-    GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
-    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
-    HAL_GPIO_Init(RS485_TX_PIN_GPIO_Port, &GPIO_InitStruct);
-
-    GPIO_InitStruct.Pin = RS485_RX_PIN_Pin;
-    GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
-    GPIO_InitStruct.Pull = GPIO_NOPULL;
-    HAL_GPIO_Init(RS485_RX_PIN_GPIO_Port, &GPIO_InitStruct);
-
-    /* USART3 interrupt Init */
-    HAL_NVIC_SetPriority(USART3_IRQn, 5, 0);
-    HAL_NVIC_EnableIRQ(USART3_IRQn);
-  }
-}
-
-/**
-* @brief UART MSP De-Initialization
-* This function freeze the hardware resources used in this example
-* @param huart: UART handle pointer
-* @retval None
-*/
-extern "C" void HAL_UART_MspDeInit(UART_HandleTypeDef *huart) {
-  if (huart->Instance == USART3) {
-    /* Peripheral clock disable */
-    __HAL_RCC_USART3_CLK_DISABLE();
-
-    /**USART3 GPIO Configuration    
-    PB10     ------> USART3_TX
-    PB11     ------> USART3_RX 
-    */
-    HAL_GPIO_DeInit(RS485_TX_PIN_GPIO_Port, RS485_TX_PIN_Pin);
-    HAL_GPIO_DeInit(RS485_RX_PIN_GPIO_Port, RS485_RX_PIN_Pin);
-
-    /* USART3 interrupt Deinit */
-    HAL_NVIC_DisableIRQ(USART3_IRQn);
-  }
-}
-
-/**
-  * @brief  Rx Transfer completed callbacks.
-  * @param  huart: pointer to a UART_HandleTypeDef structure that contains
-  *                the configuration information for the specified UART module.
-  * @retval None
-  */
-extern "C" void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {
-  debug_printf("{%02x err:%d}", gModbusChar, huart->ErrorCode);
-  if (gModbus_RX_Buffer_count < sizeof(gModbus_RX_Buffer)) {
-    gModbus_RX_Buffer[gModbus_RX_Buffer_count++] = gModbusChar;
+/***
+ *  USART3: idle line starts the silence timer, transmission complete switches back to RX
+ ***/
+extern "C" void USART3_IRQHandler(void) {
+  MONITOR_ISR_ENTER();
+  uint32_t sr = USART3->SR;
+  if (sr & (USART_SR_PE | USART_SR_FE | USART_SR_NE | USART_SR_ORE))
+    gModbus_RX_Error = true;
+  if (sr & (USART_SR_IDLE | USART_SR_PE | USART_SR_FE | USART_SR_NE | USART_SR_ORE)) {
+    (void)USART3->DR; // reading SR followed by DR clears the flags
+    if (sr & USART_SR_IDLE) {
+      gModbus_RX_IdleHead = modbus_rx_head();
+      TIM4->CNT = 0;
+      TIM4->CR1 |= TIM_CR1_CEN;
+    }
   }
-  HAL_StatusTypeDef status = HAL_UART_Receive_IT(huart, &gModbusChar, 1);
-  if(status != HAL_OK) {
-    debug_printf("HAL_UART_Receive_IT error #%d\n", status);
+  if ((sr & USART_SR_TC) and (USART3->CR1 & USART_CR1_TCIE)) {
+    CLEAR_BIT(USART3->CR1, USART_CR1_TCIE);
+    gModbusExtension->set_tx_mode(false);
   }
+  MONITOR_ISR_LEAVE(eMonitorISR_USART3);
 }
 
-/**
-  * @brief  Tx Transfer completed callbacks.
-  * @param  huart: pointer to a UART_HandleTypeDef structure that contains
-  *                the configuration information for the specified UART module.
-  * @retval None
-  */
-extern "C" void HAL_UART_TxCpltCallback(UART_HandleTypeDef *huart) {
-  debug_printf("X");
-}
-
-extern "C" void USART3_IRQHandler(void) {
-  HAL_UART_IRQHandler(&huart3);
+/***
+ *  TIM4: 3.5 characters of silence after the last character => end of frame
+ ***/
+extern "C" void TIM4_IRQHandler(void) {
+  TIM4->SR = 0;
+  if (modbus_rx_head() != gModbus_RX_IdleHead) // more data arrived, wait for the next idle line
+    return;
+  ctl_events_set_clear(&gModbusEvent, eModbusEvent_frameReceived, 0);
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -10,10 +10,27 @@
 
 #include "LoxLegacyExtension.hpp"
 #if EXTENSION_MODBUS
-//#include "queue.h"
-
-#define Modbus_RX_BUFFERSIZE 64
+#include <ctl_api.h>
+#include <stddef.h>
+
+#define Modbus_RX_BUFFERSIZE 256 // maximum size of a Modbus RTU frame
+#define Modbus_RX_RING_SIZE 256  // DMA receive ring, has to be a power of 2
+#define Modbus_MAX_DEVICES 254
+#define Modbus_IDLE_WAIT_MS 100 // maximum wait for Miniserver commands, if no device is due
+#define Modbus_GROUP_MAX_REGS 32 // maximum number of registers read with one request
+#define Modbus_GROUP_MAX_GAP 0   // unused registers allowed between two entries of a group
+// Sensor values are only sent to the Miniserver, if they changed or the refresh is due. The configuration
+// of the Miniserver has no deadband or refresh time per device entry, so every change is sent and the
+// refresh time is the same for all entries.
+#define Modbus_REFRESH_MS 60000 // send the value at least this often, even if unchanged
+#define Modbus_MAX_SLAVES 248             // slave addresses 0..247
+#define Modbus_MAX_SLAVE_STATES 32        // slaves with an adaptive timeout and backoff, all further slaves use the configured timeout
+#define Modbus_MIN_TIMEOUT_MS 20          // lower limit for the adaptive reply timeout
+#define Modbus_BACKOFF_FAILURES 3         // consecutive requests without reply, until a slave is considered offline
+#define Modbus_BACKOFF_MIN_MS 1000        // first probe of an offline slave after this time, doubled with each failed probe
+#define Modbus_BACKOFF_MAX_MS 60000
 #define Modbus_TX_BUFFERSIZE 1024
+#define Modbus_TASK_STACKSIZE 256
 
 // Modbus commands
 typedef enum {
@@ -37,7 +54,10 @@ typedef enum {
   tModbusCode_ReadDeviceIdentification = 43,
 } tModbusCode;
 
-// Possible error states, returned to the Miniserver
+// Possible error states, returned to the Miniserver with the debug command:
+// value8 = function code, value16 = tModbusError, value32 = depends on the error.
+// Replies to a debug request from the Miniserver have tModbusError_SlaveStatistics set in value16:
+// value8 = slave address, value16 = flag | reply timeout in ms, value32 = requests without reply << 16 | requests with reply
 typedef enum {
   tModbusError_ActorResponse = 0,
   tModbusError_NoResponse = 1,
@@ -45,7 +65,9 @@ typedef enum {
   tModbusError_InvalidResponse = 3,
   tModbusError_InvalidReceiveLength = 4,
   tModbusError_UnexpectedError = 5,
-  tModbusError_TxQueueOverrun = 6,
+  tModbusError_TxQueueOverrun = 6, // the queue for commands from the Miniserver is full
+  tModbusError_PollOverrun = 7,    // a device entry missed its polling cycle, value = device index
+  tModbusError_SlaveStatistics = 0x8000, // flag: not an error, but the statistics of a slave
 } tModbusError;
 
 // Possible error states, returned to the Miniserver
@@ -80,26 +102,93 @@ typedef struct {            // default values:
   uint32_t timingPause;   // 10
   uint32_t timingTimeout; // 1000
   uint32_t entryCount;    // 0 number of entries in the device table
-  sModbusDeviceConfig devices[254];
+  sModbusDeviceConfig devices[Modbus_MAX_DEVICES];
   uint32_t filler; // first value after the CRC32 checksum
 } sModbusConfig;
 
+/***
+ *  Last value sent to the Miniserver for a device entry
+ ***/
+typedef struct {
+  uint32_t value;  // raw value, as sent to the Miniserver
+  CTL_TIME_t time; // when the value was sent, set Modbus_REFRESH_MS into the past to send the next value in any case
+} sModbusSensorCache;
+
+/***
+ *  Reply timing and availability of a slave
+ ***/
+typedef struct {
+  uint16_t srtt;          // smoothed round trip time in ms << 3, 0 = no measurement yet
+  uint16_t rttvar;        // round trip time variation in ms << 2
+  uint16_t replyCount;    // statistics: requests with a reply
+  uint16_t noReplyCount;  // statistics: requests without a reply
+  uint8_t failures;       // consecutive requests without a reply
+  uint8_t backoffShift;   // number of failed probes while offline
+  CTL_TIME_t backoffUntil; // an offline slave is probed again at this time
+} sModbusSlaveState;
+
+/***
+ *  Device entries polled with a single request: same slave address, function code and polling
+ *  cycle with consecutive registers. Entries, which can not be merged, are a group of their own.
+ ***/
+typedef struct {
+  uint16_t firstReg;
+  uint16_t regCount;
+  uint8_t firstMember; // index into pollMembers
+  uint8_t memberCount;
+} sModbusPollGroup;
+
 
 class LoxLegacyModbusExtension : public LoxLegacyExtension {
-  StaticQueue_t txQueue;
-  uint8_t fragData[sizeof(config)];
+  CTL_BYTE_QUEUE_t txQueue;
+  uint8_t fragData[sizeof(sModbusConfig)];
   sModbusConfig config;
-  int32_t deviceTimeout[254];
+  sModbusConfig configPending; // a new configuration, loaded by the Modbus task between two transmissions
+  CTL_MUTEX_t configMutex;     // protects configPending
+  sModbusPollGroup pollGroups[Modbus_MAX_DEVICES];
+  uint8_t pollMembers[Modbus_MAX_DEVICES];      // device entries sorted by group and register
+  int pollGroupCount;
+  CTL_TIME_t pollDue[Modbus_MAX_DEVICES];       // next deadline for each group
+  uint8_t pollHeap[Modbus_MAX_DEVICES];         // min-heap of groups, sorted by pollDue
+  int pollHeapCount;
+  bool pollOverrun[Modbus_MAX_DEVICES];         // group missed its polling cycle
+  uint32_t pollOverrunCount;
+  sModbusSensorCache sensors[Modbus_MAX_DEVICES];
+  uint8_t slaveIndex[Modbus_MAX_SLAVES]; // index into slaves + 1, 0 = no state for this address yet
+  sModbusSlaveState slaves[Modbus_MAX_SLAVE_STATES];
+  int slaveCount;
   uint32_t characterTime_us; // duration for one character transmission in us
+  uint32_t silenceTime_us;   // 3.5 characters of silence mark the end of a frame
   uint32_t timePause;
   uint32_t timeTimeout;
 
-  void set_tx_mode(bool txMode);
   void config_load(void);
   void rs485_setup(void);
-  bool _transmitBuffer(int devIndex, const uint8_t *buffer, size_t byteCount);
-  bool transmitBuffer(int devIndex, const uint8_t *buffer, size_t byteCount);
-  static void vModbusRXTask(void *pvParameters);
+  void rs485_dma_setup(void);
+  void rs485_transmit(const uint8_t *buffer, size_t byteCount);
+  int rs485_receive(uint8_t *buffer, size_t bufferSize, uint32_t timeout_ms);
+  sModbusSlaveState *slave_state(uint8_t address, bool create);
+  const sModbusSlaveState *slave_state(uint8_t address) const;
+  uint32_t slave_timeout_ms(uint8_t address, uint32_t txTime_ms) const;
+  void slave_reply(uint8_t address, uint32_t rtt_ms);
+  void slave_no_reply(uint8_t address);
+  bool slave_available(uint8_t address) const;
+  void send_slave_statistics(void);
+  bool _transmitBuffer(int devIndex, const uint8_t *buffer, size_t byteCount, const sModbusPollGroup *group);
+  bool transmitBuffer(int devIndex, const uint8_t *buffer, size_t byteCount, const sModbusPollGroup *group = NULL);
+  uint32_t poll_cycle_ms(const sModbusDeviceConfig *dc) const;
+  uint16_t poll_reg_count(const sModbusDeviceConfig *dc) const;
+  bool poll_member_before(int a, int b) const;
+  bool poll_can_merge(const sModbusPollGroup *group, int devIndex) const;
+  void poll_build_groups(void);
+  bool poll_due_before(int a, int b) const;
+  void poll_schedule_init(void);
+  int poll_next_due(CTL_TIME_t &wait);
+  void poll_device(int devIndex, uint8_t *txBuffer);
+  void poll_group(int groupIndex, uint8_t *txBuffer);
+  void sensor_invalidate(void);
+  void send_sensor_value(int devIndex, uint32_t value);
+  bool forward_command(uint8_t *txBuffer);
   static void vModbusTXTask(void *pvParameters);
 
   virtual void PacketToExtension(LoxCanMessage &message);
@@ -109,6 +198,8 @@ class LoxLegacyModbusExtension : public LoxLegacyExtension {
 public:
   LoxLegacyModbusExtension(LoxCANBaseDriver &driver, uint32_t serial);
 
+  void set_tx_mode(bool txMode);
+
   virtual void Startup(void);
 };
 
@@ -7,21 +7,138 @@
 
 #include "LoxLegacyRS232Extension.hpp"
 #if EXTENSION_RS232
+#include "Monitor.hpp"
 #include "global_functions.hpp"
 #include "stm32f1xx_hal_conf.h"
 #include "stm32f1xx_hal_dma.h"
 #include "stm32f1xx_hal_gpio.h"
 #include "stm32f1xx_hal_rcc.h"
 #include "stm32f1xx_hal_uart.h"
-#include "stream_buffer.h"
-#include "task.h"
 #include <__cross_studio_io.h>
 #include <string.h>
 
 static UART_HandleTypeDef huart1;
-static uint8_t gChar;
-static uint8_t gUART_RX_Buffer[RS232_RX_BUFFERSIZE];
-static StreamBufferHandle_t gUART_RX_Stream;
+static CTL_EVENT_SET_t gRS232Event;
+
+enum {
+  eRS232Event_txSpace = 0x01, // a chunk was transferred, the ring has space again
+  eRS232Event_rxData = 0x02,  // the RX DMA is half/completely through the ring or the line became idle
+};
+
+// RX ring buffer, which is filled by DMA1 channel 5 in circular mode
+static uint8_t gUART_RX_Ring[RS232_RX_BUFFERSIZE];
+static volatile uint32_t gUART_RX_Laps; // number of times the DMA wrapped around the ring
+static uint8_t gUART_RX_Frame[RS232_RX_MAX_FRAME]; // a frame is copied out of the ring, before it is sent
+static uint32_t gUART_RX_Overruns;      // number of times unforwarded data was overwritten by the DMA
+
+// TX ring buffer, which is drained by DMA1 channel 4 in contiguous chunks
+static uint8_t gUART_TX_Ring[RS232_TX_BUFFERSIZE];
+static volatile uint32_t gUART_TX_Head;  // next byte to write, only changed by sendBuffer()
+static volatile uint32_t gUART_TX_Tail;  // first byte of the chunk in transfer
+static volatile uint32_t gUART_TX_Chunk; // size of the chunk in transfer, 0 = DMA is idle
+static CTL_MUTEX_t gUART_TX_Mutex;       // the CAN task and the RX task (ACK/NAK) both send
+
+/***
+ *  Setup the USART1 pins and the interrupt. Done here and not in HAL_UART_MspInit(),
+ *  because several extensions with different UARTs can run on one board.
+ ***/
+static void rs232_gpio_init(void) {
+  GPIO_InitTypeDef GPIO_InitStruct = {0};
+  __HAL_RCC_USART1_CLK_ENABLE();
+  __HAL_RCC_GPIOA_CLK_ENABLE();
+  /**USART1 GPIO Configuration
+  PA9     ------> USART1_TX
+  PA10     ------> USART1_RX
+  */
+  GPIO_InitStruct.Pin = GPIO_PIN_9;
+  GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
+  GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
+  HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+
+  GPIO_InitStruct.Pin = GPIO_PIN_10;
+  GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
+  GPIO_InitStruct.Pull = GPIO_NOPULL;
+  HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
+
+  HAL_NVIC_SetPriority(USART1_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(USART1_IRQn);
+}
+
+/***
+ *  DMA1 channel 5: USART1_RX => RX ring, runs forever. The RX task is woken up
+ *  at the half/end of the ring and by the idle line interrupt.
+ *  DMA1 channel 4: TX ring => USART1_TX, the transfer complete interrupt starts the next chunk
+ ***/
+static void rs232_dma_init(void) {
+  __HAL_RCC_DMA1_CLK_ENABLE();
+  DMA1_Channel5->CCR = 0;
+  DMA1_Channel5->CPAR = (uint32_t)&USART1->DR;
+  DMA1_Channel5->CMAR = (uint32_t)gUART_RX_Ring;
+  DMA1_Channel5->CNDTR = RS232_RX_BUFFERSIZE;
+  DMA1_Channel5->CCR = DMA_CCR_PL_1 | DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_HTIE | DMA_CCR_TCIE | DMA_CCR_EN;
+  HAL_NVIC_SetPriority(DMA1_Channel5_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel5_IRQn);
+
+  DMA1_Channel4->CCR = 0;
+  DMA1_Channel4->CPAR = (uint32_t)&USART1->DR;
+  DMA1_Channel4->CCR = DMA_CCR_PL_0 | DMA_CCR_MINC | DMA_CCR_DIR | DMA_CCR_TCIE;
+  HAL_NVIC_SetPriority(DMA1_Channel4_IRQn, 5, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel4_IRQn);
+}
+
+/***
+ *  Start the DMA for the next contiguous chunk of the TX ring, if there is one.
+ *  Called with interrupts disabled or from the DMA interrupt.
+ ***/
+static void rs232_tx_start_chunk(void) {
+  uint32_t head = gUART_TX_Head;
+  uint32_t tail = gUART_TX_Tail;
+  if (head == tail) {
+    gUART_TX_Chunk = 0;
+    return;
+  }
+  uint32_t count = (head > tail ? head : RS232_TX_BUFFERSIZE) - tail; // stop at the end of the ring
+  DMA1_Channel4->CCR &= ~DMA_CCR_EN;
+  DMA1_Channel4->CMAR = (uint32_t)&gUART_TX_Ring[tail];
+  DMA1_Channel4->CNDTR = count;
+  gUART_TX_Chunk = count;
+  DMA1_Channel4->CCR |= DMA_CCR_EN;
+}
+
+/***
+ *  Drop everything not yet transmitted, e.g. before the UART is reconfigured
+ ***/
+static void rs232_tx_abort(void) {
+  int en = ctl_global_interrupts_disable();
+  DMA1_Channel4->CCR &= ~DMA_CCR_EN;
+  DMA1->IFCR = DMA_IFCR_CTCIF4;
+  gUART_TX_Tail = gUART_TX_Head;
+  gUART_TX_Chunk = 0;
+  ctl_global_interrupts_set(en);
+  ctl_events_set_clear(&gRS232Event, eRS232Event_txSpace, 0);
+}
+
+/***
+ *  Number of bytes the DMA wrote into the RX ring since the start (modulo 2^32).
+ *  The position in the ring is the lower bits. If the ring wrapped, but the transfer complete
+ *  interrupt is still pending, the lap is counted here.
+ ***/
+static uint32_t rs232_rx_position(void) {
+  int en = ctl_global_interrupts_disable();
+  uint32_t laps = gUART_RX_Laps;
+  uint32_t head = (RS232_RX_BUFFERSIZE - DMA1_Channel5->CNDTR) & (RS232_RX_BUFFERSIZE - 1);
+  if ((DMA1->ISR & DMA_ISR_TCIF5) and head < RS232_RX_BUFFERSIZE / 2)
+    ++laps;
+  ctl_global_interrupts_set(en);
+  return laps * RS232_RX_BUFFERSIZE + head;
+}
+
+/***
+ *  Were bytes starting at the position tail already overwritten by the DMA?
+ ***/
+static inline bool rs232_rx_overrun(uint32_t tail) {
+  return rs232_rx_position() - tail > RS232_RX_BUFFERSIZE;
+}
 
 /***
  *  Constructor
@@ -31,7 +148,7 @@ LoxLegacyRS232Extension::LoxLegacyRS232Extension(LoxCANBaseDriver &driver, uint3
 }
 
 /***
- *  Forward a received buffer to the CAN bus to the Miniserver
+ *  Forward a received frame to the CAN bus to the Miniserver
  ***/
 void LoxLegacyRS232Extension::forwardBuffer(const uint8_t *buffer, size_t byteCount) {
   // ACK/NAK only works if a checksum mode is active
@@ -90,72 +207,122 @@ void LoxLegacyRS232Extension::forwardBuffer(const uint8_t *buffer, size_t byteCo
 }
 
 /***
- *  Send a buffer to the RS232
+ *  Send a buffer to the RS232: copy it into the TX ring and start the DMA, if it is idle.
+ *  Only waits, if the ring is full.
  ***/
 void LoxLegacyRS232Extension::sendBuffer(const uint8_t *buffer, size_t byteCount) {
 #if DEBUG && 0
   debug_print_buffer(buffer, byteCount, "RS232 TX:");
 #endif
-  for (int i = 0; i < byteCount; ++i) {
-    xQueueSendToBack(&this->txQueue, &buffer[i], 0);
+  ctl_mutex_lock(&gUART_TX_Mutex, CTL_TIMEOUT_NONE, 0);
+  while (byteCount > 0) {
+    ctl_events_set_clear(&gRS232Event, 0, eRS232Event_txSpace);
+    uint32_t head = gUART_TX_Head;
+    uint32_t space = (gUART_TX_Tail - head - 1) & (RS232_TX_BUFFERSIZE - 1);
+    if (space == 0) {
+      if (!ctl_events_wait(CTL_EVENT_WAIT_ANY_EVENTS_WITH_AUTO_CLEAR, &gRS232Event, eRS232Event_txSpace, CTL_TIMEOUT_DELAY, RS232_TX_TIMEOUT_MS)) {
+#if DEBUG
+        debug_printf("### RS232 TX timeout, %d bytes dropped\n", byteCount);
+#endif
+        break;
+      }
+      continue;
+    }
+    size_t count = RS232_TX_BUFFERSIZE - head; // copy up to the end of the ring
+    if (count > space)
+      count = space;
+    if (count > byteCount)
+      count = byteCount;
+    memcpy(&gUART_TX_Ring[head], buffer, count);
+    buffer += count;
+    byteCount -= count;
+
+    int en = ctl_global_interrupts_disable();
+    gUART_TX_Head = (head + count) & (RS232_TX_BUFFERSIZE - 1);
+    if (gUART_TX_Chunk == 0)
+      rs232_tx_start_chunk();
+    ctl_global_interrupts_set(en);
   }
+  ctl_mutex_unlock(&gUART_TX_Mutex);
 }
 
 /***
- *  RS232 RX Task
+ *  Search the end character in the RX ring between the positions from and to
  ***/
-void LoxLegacyRS232Extension::vRS232RXTask(void *pvParameters) {
-  LoxLegacyRS232Extension *_this = (LoxLegacyRS232Extension *)pvParameters;
-  static uint8_t buffer[RS232_RX_BUFFERSIZE];
-  size_t bufferFill = 0;
-  while (1) {
-    size_t byteCount = xStreamBufferReceive(gUART_RX_Stream, buffer + bufferFill, RS232_RX_BUFFERSIZE - bufferFill, 10);
-    bufferFill += byteCount;
-#if DEBUG && 0
-    debug_print_buffer(buffer, byteCount, "RS232 RX:");
-#endif
-    if (byteCount > 0) {
-      if (not _this->hasEndCharacter or bufferFill == RS232_RX_BUFFERSIZE) {
-        // if we don't wait for an end-character or the buffer is full anyway
-        // just sent the data
-        _this->forwardBuffer(buffer, bufferFill);
-        bufferFill = 0;
-      } else {
-        for (size_t pos = 0; pos < bufferFill; ++pos) {
-          if (buffer[pos] == _this->endCharacter) {
-            size_t count = pos + 1; // number of bytes including the end character
-             // WARNING Loxone RS232 extension forwards `count`, not `count - 1`,
-             // which means it never works with a checksum active, because the
-             // endCharacter is stored in the last byte, which is where the following
-             // code expects the checksum to be. Without the checksum, ACK/NAK will
-             // obviously not work. So, for Loxone it will always send NAK (and
-             // sometimes, 1/256%, ACK). Feels like a Loxone bug.
-            _this->forwardBuffer(buffer, count);
-            // move the remaining bytes down
-            bufferFill -= count;
-            memmove(buffer, buffer + count, bufferFill);
-            break;
-          }
-        }
-      }
-    }
+static const uint8_t *rs232_find_end(uint8_t endCharacter, uint32_t from, uint32_t to) {
+  from &= RS232_RX_BUFFERSIZE - 1;
+  to &= RS232_RX_BUFFERSIZE - 1;
+  if (to < from) { // wraps around the end of the ring
+    const uint8_t *end = (const uint8_t *)memchr(&gUART_RX_Ring[from], endCharacter, RS232_RX_BUFFERSIZE - from);
+    if (end)
+      return end;
+    from = 0;
   }
+  return (const uint8_t *)memchr(&gUART_RX_Ring[from], endCharacter, to - from);
+}
+
+/***
+ *  Copy count bytes starting at the position tail out of the RX ring
+ ***/
+static void rs232_rx_copy(uint8_t *dest, uint32_t tail, size_t count) {
+  uint32_t index = tail & (RS232_RX_BUFFERSIZE - 1);
+  size_t count1 = RS232_RX_BUFFERSIZE - index;
+  if (count1 > count)
+    count1 = count;
+  memcpy(dest, &gUART_RX_Ring[index], count1);
+  memcpy(dest + count1, gUART_RX_Ring, count - count1);
 }
 
 /***
- *  RS232 TX Task
+ *  RS232 RX Task: forwards complete frames out of the RX ring. Sending a frame can block,
+ *  while the CAN bus is congested, so the frame is copied out of the ring first. If the DMA
+ *  overwrites data, which was not yet copied, that data is dropped and counted as an overrun.
+ *  tail, scan and head are positions as returned by rs232_rx_position().
  ***/
-void LoxLegacyRS232Extension::vRS232TXTask(void *pvParameters) {
+void LoxLegacyRS232Extension::vRS232RXTask(void *pvParameters) {
   LoxLegacyRS232Extension *_this = (LoxLegacyRS232Extension *)pvParameters;
+  uint32_t tail = rs232_rx_position(); // first byte not yet forwarded
+  uint32_t scan = tail;                // first byte not yet searched for the end character
   while (1) {
-    uint8_t byte;
-    while (xQueueReceive(&_this->txQueue, &byte, 0)) {
-      HAL_StatusTypeDef status = HAL_UART_Transmit(&huart1, &byte, sizeof(byte), 50);
-      if (status != HAL_OK) {
+    ctl_events_wait(CTL_EVENT_WAIT_ANY_EVENTS_WITH_AUTO_CLEAR, &gRS232Event, eRS232Event_rxData, CTL_TIMEOUT_NONE, 0);
+    uint32_t head = rs232_rx_position();
+    while (tail != head) {
+      if (head - tail > RS232_RX_BUFFERSIZE) { // the DMA lapped us
+        ++gUART_RX_Overruns;
 #if DEBUG
-        debug_printf("### RS232 TX error %d\n", status);
+        debug_printf("### RS232 RX overrun #%d, %d bytes dropped\n", gUART_RX_Overruns, head - tail);
 #endif
+        tail = scan = head;
+        break;
+      }
+      uint32_t end = head; // frame: tail...end-1
+      // if we don't wait for an end-character or the frame is too long anyway
+      // just sent the data
+      if (_this->hasEndCharacter and head - tail < RS232_RX_MAX_FRAME) {
+        const uint8_t *endPtr = rs232_find_end(_this->endCharacter, scan, head);
+        if (!endPtr) { // incomplete, wait for more data
+          scan = head;
+          break;
+        }
+        // WARNING Loxone RS232 extension forwards the frame including the end character,
+        // which means it never works with a checksum active, because the
+        // endCharacter is stored in the last byte, which is where the following
+        // code expects the checksum to be. Without the checksum, ACK/NAK will
+        // obviously not work. So, for Loxone it will always send NAK (and
+        // sometimes, 1/256%, ACK). Feels like a Loxone bug.
+        end = tail + ((endPtr - gUART_RX_Ring - tail + 1) & (RS232_RX_BUFFERSIZE - 1));
       }
+      if (end - tail > RS232_RX_MAX_FRAME)
+        end = tail + RS232_RX_MAX_FRAME;
+      size_t count = end - tail;
+      rs232_rx_copy(gUART_RX_Frame, tail, count);
+      if (rs232_rx_overrun(tail)) { // overwritten while copying, dropped above
+        head = rs232_rx_position();
+        continue;
+      }
+      tail = scan = end;
+      _this->forwardBuffer(gUART_RX_Frame, count);
+      head = rs232_rx_position(); // the DMA continued while the frame was sent
     }
   }
 }
@@ -164,22 +331,15 @@ void LoxLegacyRS232Extension::vRS232TXTask(void *pvParameters) {
  *  Setup GPIOs
  ***/
 void LoxLegacyRS232Extension::Startup(void) {
-  __HAL_RCC_USART3_CLK_ENABLE();
-  __HAL_RCC_GPIOB_CLK_ENABLE();
-
-  static StaticStreamBuffer_t gUART_RX_Buffer_Stuct;
-  gUART_RX_Stream = xStreamBufferCreateStatic(RS232_RX_BUFFERSIZE, 1, gUART_RX_Buffer, &gUART_RX_Buffer_Stuct);
+  ctl_mutex_init(&gUART_TX_Mutex);
+  ctl_events_init(&gRS232Event, 0);
 
-  static uint8_t sRS232TXBuffer[RS232_TX_BUFFERSIZE];
-  xQueueCreateStatic(RS232_TX_BUFFERSIZE, 1, (uint8_t *)sRS232TXBuffer, &this->txQueue);
+  rs232_gpio_init();
+  rs232_dma_init();
 
-  static StackType_t sRS232RXTaskStack[configMINIMAL_STACK_SIZE];
-  static StaticTask_t sRS232RXTask;
-  xTaskCreateStatic(LoxLegacyRS232Extension::vRS232RXTask, "RS232RXTask", configMINIMAL_STACK_SIZE, this, 2, sRS232RXTaskStack, &sRS232RXTask);
-
-  static StackType_t sRS232TXTaskStack[configMINIMAL_STACK_SIZE];
-  static StaticTask_t sRS232TXTask;
-  xTaskCreateStatic(LoxLegacyRS232Extension::vRS232TXTask, "RS232TXTask", configMINIMAL_STACK_SIZE, this, 2, sRS232TXTaskStack, &sRS232TXTask);
+  static unsigned sRS232RXTaskStack[1 + RS232_TASK_STACKSIZE + 1];
+  static CTL_TASK_t sRS232RXTask;
+  monitor_task_run(&sRS232RXTask, 0x08, LoxLegacyRS232Extension::vRS232RXTask, this, "RS232_RX", RS232_TASK_STACKSIZE, sRS232RXTaskStack);
 
   huart1.Instance = USART1;
   huart1.Init.BaudRate = 9600;
@@ -195,10 +355,9 @@ void LoxLegacyRS232Extension::Startup(void) {
 #endif
   }
 
-  // RXNE Interrupt Enable
-  SET_BIT(huart1.Instance->CR1, USART_CR1_RXNEIE);
-
-  HAL_UART_Receive_IT(&huart1, &gChar, 1);
+  // RX/TX via DMA, Idle Line Interrupt Enable
+  SET_BIT(huart1.Instance->CR3, USART_CR3_DMAR | USART_CR3_DMAT);
+  SET_BIT(huart1.Instance->CR1, USART_CR1_IDLEIE);
 }
 
 void LoxLegacyRS232Extension::PacketToExtension(LoxCanMessage &message) {
@@ -230,6 +389,7 @@ void LoxLegacyRS232Extension::PacketToExtension(LoxCanMessage &message) {
     }
     debug_printf("# RS232 config hardware %d%s%d, %d baud, endChar:%d:0x%02x, unknown:0x%02x\n", bits, pstr, stopBits, message.value32, this->hasEndCharacter, this->endCharacter, message.data[2]);
 #endif
+    rs232_tx_abort();
     if (HAL_UART_DeInit(&huart1) != HAL_OK) {
 #if DEBUG
       debug_printf("### RS232 HAL_UART_DeInit ERROR\n");
@@ -248,7 +408,8 @@ void LoxLegacyRS232Extension::PacketToExtension(LoxCanMessage &message) {
       debug_printf("### RS232 HAL_UART_Init ERROR\n");
 #endif
     }
-    HAL_UART_Receive_IT(&huart1, &gChar, 1);
+    SET_BIT(huart1.Instance->CR3, USART_CR3_DMAR | USART_CR3_DMAT);
+    SET_BIT(huart1.Instance->CR1, USART_CR1_IDLEIE);
     break;
   }
   case RS232_send_bytes: {
@@ -313,92 +474,41 @@ void LoxLegacyRS232Extension::PacketToExtension(LoxCanMessage &message) {
   }
 }
 
-/**
-* @brief UART MSP Initialization
-* This function configures the hardware resources used in this example
-* @param huart: UART handle pointer
-* @retval None
-*/
-extern "C" void HAL_UART_MspInit(UART_HandleTypeDef *huart) {
-  GPIO_InitTypeDef GPIO_InitStruct = {0};
-  if (huart->Instance == USART1) {
-    /* Peripheral clock enable */
-    __HAL_RCC_USART1_CLK_ENABLE();
-
-    __HAL_RCC_GPIOA_CLK_ENABLE();
-    /**USART1 GPIO Configuration    
-    PA9     ------> USART1_TX
-    PA10     ------> USART1_RX 
-    */
-    GPIO_InitStruct.Pin = GPIO_PIN_9;
-    GPIO_InitStruct.Mode = GPIO_MODE_AF_PP;
-    GPIO_InitStruct.Speed = GPIO_SPEED_FREQ_HIGH;
-    HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
-
-    GPIO_InitStruct.Pin = GPIO_PIN_10;
-    GPIO_InitStruct.Mode = GPIO_MODE_INPUT;
-    GPIO_InitStruct.Pull = GPIO_NOPULL;
-    HAL_GPIO_Init(GPIOA, &GPIO_InitStruct);
-
-    /* USART1 interrupt Init */
-    HAL_NVIC_SetPriority(USART1_IRQn, 5, 0);
-    HAL_NVIC_EnableIRQ(USART1_IRQn);
+/***
+ *  USART1: the line became idle, let the RX task look for a complete frame
+ ***/
+extern "C" void USART1_IRQHandler(void) {
+  MONITOR_ISR_ENTER();
+  if (USART1->SR & USART_SR_IDLE) {
+    (void)USART1->DR; // reading SR followed by DR clears IDLE
+    ctl_events_set_clear(&gRS232Event, eRS232Event_rxData, 0);
   }
+  MONITOR_ISR_LEAVE(eMonitorISR_USART1);
 }
 
-/**
-* @brief UART MSP De-Initialization
-* This function freeze the hardware resources used in this example
-* @param huart: UART handle pointer
-* @retval None
-*/
-extern "C" void HAL_UART_MspDeInit(UART_HandleTypeDef *huart) {
-  if (huart->Instance == USART1) {
-    /* Peripheral clock disable */
-    __HAL_RCC_USART1_CLK_DISABLE();
-
-    /**USART1 GPIO Configuration    
-    PA9     ------> USART1_TX
-    PA10     ------> USART1_RX 
-    */
-    HAL_GPIO_DeInit(GPIOA, GPIO_PIN_9 | GPIO_PIN_10);
-
-    /* USART1 interrupt DeInit */
-    HAL_NVIC_DisableIRQ(USART1_IRQn);
-  }
+/***
+ *  DMA1 channel 5: the RX ring is half or completely filled
+ ***/
+extern "C" void DMA1_Channel5_IRQHandler(void) {
+  MONITOR_ISR_ENTER();
+  if (DMA1->ISR & DMA_ISR_TCIF5) // wrapped around the end of the ring
+    ++gUART_RX_Laps;
+  DMA1->IFCR = DMA_IFCR_CHTIF5 | DMA_IFCR_CTCIF5 | DMA_IFCR_CGIF5;
+  ctl_events_set_clear(&gRS232Event, eRS232Event_rxData, 0);
+  MONITOR_ISR_LEAVE(eMonitorISR_USART1); // accounted to the UART it serves
 }
 
-/**
-  * @brief  Rx Transfer completed callbacks.
-  * @param  huart: pointer to a UART_HandleTypeDef structure that contains
-  *                the configuration information for the specified UART module.
-  * @retval None
-  */
-extern "C" void HAL_UART_RxCpltCallback(UART_HandleTypeDef *huart) {
-  // Attempt to send the string to the stream buffer.
-  BaseType_t xHigherPriorityTaskWoken = pdFALSE; // Initialised to pdFALSE.
-  size_t xBytesSent = xStreamBufferSendFromISR(gUART_RX_Stream, &gChar, 1, &xHigherPriorityTaskWoken);
-  if (xBytesSent != 1) {
-#if DEBUG
-    debug_printf("RS232 RX Stream error");
-#endif
-  }
-  HAL_UART_Receive_IT(huart, &gChar, 1);
-
-  // If xHigherPriorityTaskWoken was set to pdTRUE inside
-  // xStreamBufferSendFromISR() then a task that has a priority above the
-  // priority of the currently executing task was unblocked and a context
-  // switch should be performed to ensure the ISR returns to the unblocked
-  // task.  In most FreeRTOS ports this is done by simply passing
-  // xHigherPriorityTaskWoken into taskYIELD_FROM_ISR(), which will test the
-  // variables value, and perform the context switch if necessary.  Check the
-  // documentation for the port in use for port specific instructions.
-  if (xHigherPriorityTaskWoken) {
-    taskYIELD();
+/***
+ *  DMA1 channel 4: a TX chunk is transferred, continue with the next one
+ ***/
+extern "C" void DMA1_Channel4_IRQHandler(void) {
+  MONITOR_ISR_ENTER();
+  if (DMA1->ISR & DMA_ISR_TCIF4) {
+    DMA1->IFCR = DMA_IFCR_CTCIF4;
+    gUART_TX_Tail = (gUART_TX_Tail + gUART_TX_Chunk) & (RS232_TX_BUFFERSIZE - 1);
+    rs232_tx_start_chunk();
+    ctl_events_set_clear(&gRS232Event, eRS232Event_txSpace, 0);
   }
-}
-
-extern "C" void USART1_IRQHandler(void) {
-  HAL_UART_IRQHandler(&huart1);
+  MONITOR_ISR_LEAVE(eMonitorISR_USART1); // accounted to the UART it serves
 }
 #endif
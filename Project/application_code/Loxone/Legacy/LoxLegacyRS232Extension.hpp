@@ -10,10 +10,14 @@
 
 #include "LoxLegacyExtension.hpp"
 #if EXTENSION_RS232
-#include "queue.h"
+#include <ctl_api.h>
+#include <stddef.h>
 
-#define RS232_RX_BUFFERSIZE 512
-#define RS232_TX_BUFFERSIZE 512
+#define RS232_RX_BUFFERSIZE 512                     // has to be a power of 2. If the CAN bus stalls longer than one ring (44ms at 115200 baud), the data is dropped as an overrun
+#define RS232_RX_MAX_FRAME (RS232_RX_BUFFERSIZE / 2) // without an end character, the data is forwarded at this size
+#define RS232_TX_BUFFERSIZE 512 // has to be a power of 2
+#define RS232_TX_TIMEOUT_MS 100 // max. wait for space in the TX buffer, before data is dropped
+#define RS232_TASK_STACKSIZE 256
 
 // The different state, in which the extension can be
 typedef enum {
@@ -31,7 +35,6 @@ class LoxLegacyRS232Extension : public LoxLegacyExtension {
   uint8_t sendFill;
   uint8_t sendCRC;
   uint8_t sendData[256]; // max. size of one send buffer as received via several messages from the Miniserver
-  StaticQueue_t txQueue;
   bool hasAck;
   uint8_t ack_byte;
   bool hasNak;
@@ -43,7 +46,6 @@ class LoxLegacyRS232Extension : public LoxLegacyExtension {
   void forwardBuffer(const uint8_t *buffer, size_t byteCount);
   void sendBuffer(const uint8_t *buffer, size_t byteCount);
   static void vRS232RXTask(void *pvParameters);
-  static void vRS232TXTask(void *pvParameters);
 
   virtual void PacketToExtension(LoxCanMessage &message);
 
@@ -9,6 +9,7 @@
 #include "stm32f1xx_hal_gpio.h"
 #include "stm32f1xx_hal_rcc.h"
 #include "system.hpp"
+#include <assert.h>
 #include <stdlib.h>
 
 static const struct {
@@ -30,25 +31,78 @@ static const struct {
   {GPIO_PIN_3, GPIOD},
   {GPIO_PIN_2, GPIOD},
 };
+#define RELAY_GPIO GPIOD // all relays are on the same port, which allows switching them with a single BSRR write
+
+// BSRR values for the lower and upper 7 bits of the relay bitmask
+#define RELAY_LUT_BITS 7
+static uint32_t gRelayBSRR[2][1 << RELAY_LUT_BITS];
+
+/***
+ *  Precalculate the BSRR values: the set bits for the active relays in the lower 16 bits,
+ *  the reset bits for the inactive relays in the upper 16 bits.
+ ***/
+static void relay_init_lut(void) {
+  for (int half = 0; half < 2; ++half) {
+    for (uint32_t value = 0; value < (1 << RELAY_LUT_BITS); ++value) {
+      uint32_t bsrr = 0;
+      for (int bit = 0; bit < RELAY_LUT_BITS; ++bit) {
+        int i = half * RELAY_LUT_BITS + bit;
+        assert(gRelayPins[i].gpio == RELAY_GPIO);
+        bsrr |= (value & (1 << bit)) ? gRelayPins[i].pin : (uint32_t(gRelayPins[i].pin) << 16);
+      }
+      gRelayBSRR[half][value] = bsrr;
+    }
+  }
+}
+
+/***
+ *  Switch all relays at once
+ ***/
+void LoxLegacyRelayExtension::write_relays(uint16_t bitmask) {
+  this->harewareDigitalOutBitmask = bitmask;
+  //  debug_printf("### Relay Status 0x%x\n", this->harewareDigitalOutBitmask);
+  RELAY_GPIO->BSRR = gRelayBSRR[0][bitmask & ((1 << RELAY_LUT_BITS) - 1)] | gRelayBSRR[1][(bitmask >> RELAY_LUT_BITS) & ((1 << RELAY_LUT_BITS) - 1)];
+}
 
 /***
- *  Update the relays
+ *  Turn on the next group of pending relays
+ ***/
+void LoxLegacyRelayExtension::stagger_relays(void) {
+  uint16_t bitmask = this->harewareDigitalOutBitmask;
+  uint16_t pending = this->requestedDigitalOutBitmask & ~bitmask;
+  for (int count = 0; pending and count < RELAY_STAGGER_RELAYS_PER_SLOT; ++count) {
+    uint16_t lowest = pending & -pending;
+    bitmask |= lowest;
+    pending &= ~lowest;
+  }
+  this->staggerMsTimer = 0;
+  write_relays(bitmask);
+}
+
+/***
+ *  Update the relays. Relays are turned off immediately, turning them on is spread over
+ *  several time slots, if RELAY_STAGGER_RELAYS_PER_SLOT is set.
  ***/
 void LoxLegacyRelayExtension::update_relays(uint16_t bitmask) {
   if (this->temperatureOverheatingFlag)
     bitmask = 0;
-  this->harewareDigitalOutBitmask = bitmask;
-  //  debug_printf("### Relay Status 0x%x\n", this->harewareDigitalOutBitmask);
-  for (int i = 0; i < RELAY_EXTENSION_OUTPUTS; ++i) {
-    HAL_GPIO_WritePin(gRelayPins[i].gpio, gRelayPins[i].pin, (bitmask & (1 << i)) ? GPIO_PIN_SET : GPIO_PIN_RESET);
+  this->requestedDigitalOutBitmask = bitmask;
+  if (RELAY_STAGGER_RELAYS_PER_SLOT == 0) {
+    write_relays(bitmask);
+    return;
   }
+  uint16_t current = this->harewareDigitalOutBitmask & bitmask;
+  if (current != this->harewareDigitalOutBitmask)
+    write_relays(current);
+  if (bitmask != current and this->staggerMsTimer >= RELAY_STAGGER_SLOT_MS) // no group turned on recently?
+    stagger_relays();
 }
 
 /***
  *  Constructor
  ***/
 LoxLegacyRelayExtension::LoxLegacyRelayExtension(LoxCANBaseDriver &driver, uint32_t serial)
-  : LoxLegacyExtension(driver, (serial & 0xFFFFFF) | (eDeviceType_t_RelayExtension << 24), eDeviceType_t_RelayExtension, 2, 10031108), harewareDigitalOutBitmask(0), temperatureForceSend(false), temperatureOverheatingFlag(false), temperatureMsTimer(0), temperature(0) {
+  : LoxLegacyExtension(driver, (serial & 0xFFFFFF) | (eDeviceType_t_RelayExtension << 24), eDeviceType_t_RelayExtension, 2, 10031108), harewareDigitalOutBitmask(0), requestedDigitalOutBitmask(0), staggerMsTimer(RELAY_STAGGER_SLOT_MS), temperatureForceSend(false), temperatureOverheatingFlag(false), temperatureMsTimer(0), temperature(0) {
 }
 
 /***
@@ -65,6 +119,7 @@ void LoxLegacyRelayExtension::Startup(void) {
     GPIO_Init.Speed = GPIO_SPEED_FREQ_LOW;
     HAL_GPIO_Init(gRelayPins[i].gpio, &GPIO_Init);
   }
+  relay_init_lut();
 }
 
 /***
@@ -73,18 +128,22 @@ void LoxLegacyRelayExtension::Startup(void) {
 void LoxLegacyRelayExtension::Timer10ms(void) {
   bool doSend = this->aliveCountdown <= 0 or this->temperatureForceSend;
   LoxLegacyExtension::Timer10ms();
+  if (this->staggerMsTimer < RELAY_STAGGER_SLOT_MS)
+    this->staggerMsTimer += 10;
+  if (this->requestedDigitalOutBitmask != this->harewareDigitalOutBitmask and this->staggerMsTimer >= RELAY_STAGGER_SLOT_MS)
+    stagger_relays();
   this->temperatureMsTimer += 10;
   if (this->temperatureMsTimer >= 1000 or doSend) { // once per second
     this->temperatureMsTimer = 0;
-    float temperature = MX_read_temperature();
-    if (temperature >= 87) { // too hot?
+    int32_t temperature = MX_temperature_x10(); // filtered in the background, does not block
+    if (temperature >= 870) { // too hot?
       this->temperatureOverheatingFlag = true;
-    } else if (temperature < 72) {          // cooled down enough to get out of shutdown mode?
+    } else if (temperature < 720) {         // cooled down enough to get out of shutdown mode?
       if (this->temperatureOverheatingFlag) // were we in overheating mode and now its fine again?
         NVIC_SystemReset();                 // then just reboot the extension
     }
     // did the temperature change a lot or is this a force/regular update?
-    if (abs(int(temperature - this->temperature)) >= 5 or doSend) {
+    if (abs(temperature - this->temperature) >= 50 or doSend) {
       this->temperature = temperature;
       this->temperatureForceSend = false;
       // https://www.st.com/content/ccc/resource/technical/document/application_note/b9/21/44/4e/cf/6f/46/fa/DM00035957.pdf/files/DM00035957.pdf/jcr:content/translations/en.DM00035957.pdf
@@ -98,9 +157,9 @@ void LoxLegacyRelayExtension::Timer10ms(void) {
 
       const bool sendTempInCelcius = true;
       if (sendTempInCelcius) {
-        sendCommandWithValues(system_temperature, 0, this->temperatureOverheatingFlag << 8, temperature * 10);
+        sendCommandWithValues(system_temperature, 0, this->temperatureOverheatingFlag << 8, temperature);
       } else {
-        sendCommandWithValues(system_temperature, 1, this->temperatureOverheatingFlag << 8, ((1475 - (temperature * 10)) * 1024) / 2245);
+        sendCommandWithValues(system_temperature, 1, this->temperatureOverheatingFlag << 8, ((1475 - temperature) * 1024) / 2245);
         // Reverse conversion: tempC = (1475-(value*2245/1024))/10
       }
       // If the unit is overheating, turn the relays off
@@ -116,7 +175,7 @@ void LoxLegacyRelayExtension::PacketToExtension(LoxCanMessage &message) {
   case digital_output_value:
     update_relays(message.value32);
     // confirm that we received the command
-    sendCommandWithValues(digital_output_value, 0, 0, this->harewareDigitalOutBitmask);
+    sendCommandWithValues(digital_output_value, 0, 0, this->requestedDigitalOutBitmask);
     break;
   case LED_flash_position: // force send the temperature after reboot
     this->temperatureForceSend = true;
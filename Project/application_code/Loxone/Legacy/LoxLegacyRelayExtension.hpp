@@ -11,14 +11,20 @@
 #include "LoxLegacyExtension.hpp"
 
 #define RELAY_EXTENSION_OUTPUTS 14
+#define RELAY_STAGGER_RELAYS_PER_SLOT 0 // max. number of relays turned on at the same time to limit the inrush current, 0 = no limit
+#define RELAY_STAGGER_SLOT_MS 20        // time between two groups of turned on relays, multiple of 10ms
 
 class LoxLegacyRelayExtension : public LoxLegacyExtension {
-  uint16_t harewareDigitalOutBitmask; // 14 possible bits
+  uint16_t harewareDigitalOutBitmask; // 14 possible bits, current state of the relays
+  uint16_t requestedDigitalOutBitmask; // state requested by the Miniserver, turn-ons might be pending
+  uint32_t staggerMsTimer;
   bool temperatureForceSend;
   bool temperatureOverheatingFlag; // emergency shutdown, if relays/dimmers got too hot
-  float temperature;
+  int32_t temperature; // in 0.1 Celsius
   uint32_t temperatureMsTimer;
 
+  void write_relays(uint16_t bitmask);
+  void stagger_relays(void);
   void update_relays(uint16_t bitmask);
   virtual void PacketToExtension(LoxCanMessage &message);
 
@@ -0,0 +1,219 @@
+//
+//  LoxRDMController.cpp
+//
+//  Part of LoxLink.
+//
+
+#include "LoxRDMController.hpp"
+#include <assert.h>
+#include <string.h>
+
+/***
+ *  Store a 48-bit UID big endian
+ ***/
+static void rdm_put_uid(uint8_t *p, uint64_t uid) {
+  for (int i = 5; i >= 0; --i) {
+    p[i] = uid;
+    uid >>= 8;
+  }
+}
+
+static uint64_t rdm_get_uid(const uint8_t *p) {
+  uint64_t uid = 0;
+  for (int i = 0; i < 6; ++i)
+    uid = (uid << 8) | p[i];
+  return uid;
+}
+
+static uint16_t rdm_checksum(const uint8_t *p, int size) {
+  uint16_t checksum = 0;
+  for (int i = 0; i < size; ++i)
+    checksum += p[i];
+  return checksum;
+}
+
+/***
+ *  Constructor
+ ***/
+LoxRDMController::LoxRDMController(uint16_t manufacturerID, uint32_t deviceID)
+  : uid((uint64_t(manufacturerID) << 32) | deviceID), transactionNumber(0) {
+}
+
+/***
+ *  Build a request packet, returns its size
+ ***/
+int LoxRDMController::build_packet(uint64_t destination, eRDMCommandClass commandClass, eRDMPID pid, const uint8_t *data, int dataSize) {
+  uint8_t *p = this->packet;
+  p[0] = RDM_START_CODE;
+  p[1] = RDM_SUB_START_CODE;
+  p[2] = RDM_HEADER_SIZE + dataSize; // message length, without the checksum
+  rdm_put_uid(&p[3], destination);
+  rdm_put_uid(&p[9], this->uid);
+  p[15] = this->transactionNumber++;
+  p[16] = 0x01; // port ID
+  p[17] = 0x00; // message count
+  p[18] = 0x00; // sub-device: root
+  p[19] = 0x00;
+  p[20] = commandClass;
+  p[21] = pid >> 8;
+  p[22] = pid;
+  p[23] = dataSize;
+  if (dataSize > 0)
+    memcpy(&p[RDM_HEADER_SIZE], data, dataSize);
+  uint16_t checksum = rdm_checksum(p, RDM_HEADER_SIZE + dataSize);
+  p[RDM_HEADER_SIZE + dataSize] = checksum >> 8;
+  p[RDM_HEADER_SIZE + dataSize + 1] = checksum;
+  return RDM_HEADER_SIZE + dataSize + 2;
+}
+
+/***
+ *  Send a request to one device and check the reply. Returns the size of the
+ *  parameter data of an ACK, -1 for no or an invalid reply.
+ ***/
+int LoxRDMController::request(uint64_t destination, eRDMCommandClass commandClass, eRDMPID pid, const uint8_t *data, int dataSize, uint8_t *replyData, int replyDataSize) {
+  int size = build_packet(destination, commandClass, pid, data, dataSize);
+  int replySize = Transact(this->packet, size, this->reply, sizeof(this->reply), true);
+  const uint8_t *r = this->reply;
+  while (replySize > 0 and *r != RDM_START_CODE) { // skip the break
+    ++r;
+    --replySize;
+  }
+  if (replySize < RDM_HEADER_SIZE + 2 or r[1] != RDM_SUB_START_CODE)
+    return -1;
+  int length = r[2];
+  if (length < RDM_HEADER_SIZE or length + 2 > replySize or r[23] != length - RDM_HEADER_SIZE)
+    return -1;
+  if (rdm_checksum(r, length) != ((r[length] << 8) | r[length + 1]))
+    return -1;
+  if (rdm_get_uid(&r[3]) != this->uid or rdm_get_uid(&r[9]) != destination or r[15] != this->packet[15])
+    return -1;
+  if (r[16] != eRDMResponseType_ack or r[20] != commandClass + eRDMCommandClass_response or ((r[21] << 8) | r[22]) != pid)
+    return -1;
+  int replyDataLength = length - RDM_HEADER_SIZE;
+  if (replyDataLength > replyDataSize)
+    replyDataLength = replyDataSize;
+  memcpy(replyData, &r[RDM_HEADER_SIZE], replyDataLength);
+  return replyDataLength;
+}
+
+/***
+ *  Ask all unmuted devices within a UID range to identify themselves.
+ *  Returns 0 = no reply, 1 = exactly one valid reply (in foundUID), -1 = collision
+ ***/
+int LoxRDMController::disc_unique_branch(uint64_t lower, uint64_t upper, uint64_t &foundUID) {
+  uint8_t data[12];
+  rdm_put_uid(&data[0], lower);
+  rdm_put_uid(&data[6], upper);
+  int size = build_packet(RDM_UID_BROADCAST, eRDMCommandClass_discovery, eRDMPID_discUniqueBranch, data, sizeof(data));
+  int replySize = Transact(this->packet, size, this->reply, sizeof(this->reply), true);
+  if (replySize == 0)
+    return 0;
+  // the reply has no break: up to 7 preamble bytes 0xFE, a 0xAA, followed by the encoded UID and checksum
+  const uint8_t *r = this->reply;
+  int preamble = 0;
+  while (replySize > 0 and *r != 0xAA) {
+    if (*r != 0xFE or ++preamble > 7)
+      return -1;
+    ++r;
+    --replySize;
+  }
+  if (replySize < 1 + 16)
+    return -1;
+  ++r;
+  uint8_t decoded[8];
+  for (int i = 0; i < 8; ++i) { // every byte is sent twice: once ORed with 0xAA, once with 0x55
+    if ((r[i * 2] | 0x55) != 0xFF or (r[i * 2 + 1] | 0xAA) != 0xFF)
+      return -1;
+    decoded[i] = r[i * 2] & r[i * 2 + 1];
+  }
+  if (rdm_checksum(r, 12) != ((decoded[6] << 8) | decoded[7]))
+    return -1;
+  foundUID = rdm_get_uid(decoded);
+  if (foundUID < lower or foundUID > upper)
+    return -1;
+  return 1;
+}
+
+/***
+ *  Find all devices on the line with a binary search over the UID space. Every found device
+ *  is muted, so it no longer answers, and reported via DeviceFound(). Returns the number of devices.
+ *  A reply, which can't be muted, is handled like a collision.
+ ***/
+int LoxRDMController::Discover(void) {
+  UnmuteAll();
+  int count = 0;
+  int depth = 0;
+  this->discoveryStack[depth].lower = 0;
+  this->discoveryStack[depth].upper = RDM_UID_MAX;
+  ++depth;
+  while (depth > 0) {
+    --depth;
+    uint64_t lower = this->discoveryStack[depth].lower;
+    uint64_t upper = this->discoveryStack[depth].upper;
+    int retries = 0;
+    while (1) { // ask the same branch again, until no more devices answer
+      uint64_t foundUID;
+      int result = disc_unique_branch(lower, upper, foundUID);
+      if (result == 0)
+        break;
+      if (result > 0) {
+        if (Mute(foundUID)) {
+          if (DeviceFound(foundUID)) {
+            ++count;
+            continue;
+          }
+          // a known device answered again: a collision, which looked like a valid reply
+        } else if (lower == upper and ++retries < RDM_DISCOVERY_RETRIES) {
+          continue;
+        }
+      }
+      // collision: search both halves, the lower one first
+      if (lower == upper) // several devices with the same UID, can't be resolved
+        break;
+      assert(depth + 2 <= RDM_DISCOVERY_DEPTH);
+      if (depth + 2 > RDM_DISCOVERY_DEPTH) // can't happen, the branches halve with every level
+        break;
+      uint64_t middle = lower + (upper - lower) / 2;
+      this->discoveryStack[depth].lower = middle + 1;
+      this->discoveryStack[depth].upper = upper;
+      ++depth;
+      this->discoveryStack[depth].lower = lower;
+      this->discoveryStack[depth].upper = middle;
+      ++depth;
+      break;
+    }
+  }
+  return count;
+}
+
+/***
+ *  Allow all devices to take part in the next discovery
+ ***/
+void LoxRDMController::UnmuteAll(void) {
+  int size = build_packet(RDM_UID_BROADCAST, eRDMCommandClass_discovery, eRDMPID_discUnMute, NULL, 0);
+  Transact(this->packet, size, this->reply, sizeof(this->reply), false); // broadcasts are never answered
+}
+
+/***
+ *  Stop a device from answering DISC_UNIQUE_BRANCH requests
+ ***/
+bool LoxRDMController::Mute(uint64_t uid) {
+  uint8_t control[2];
+  return request(uid, eRDMCommandClass_discovery, eRDMPID_discMute, NULL, 0, control, sizeof(control)) >= 0;
+}
+
+/***
+ *  DMX start address of a device (1..512), -1 on error
+ ***/
+int LoxRDMController::GetStartAddress(uint64_t uid) {
+  uint8_t address[2];
+  if (request(uid, eRDMCommandClass_get, eRDMPID_dmxStartAddress, NULL, 0, address, sizeof(address)) != sizeof(address))
+    return -1;
+  return (address[0] << 8) | address[1];
+}
+
+bool LoxRDMController::SetStartAddress(uint64_t uid, uint16_t address) {
+  uint8_t data[2] = {uint8_t(address >> 8), uint8_t(address)};
+  uint8_t dummy[1];
+  return request(uid, eRDMCommandClass_set, eRDMPID_dmxStartAddress, data, sizeof(data), dummy, 0) >= 0;
+}
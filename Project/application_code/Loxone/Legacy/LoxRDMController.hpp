@@ -0,0 +1,74 @@
+//
+//  LoxRDMController.hpp
+//
+//  Part of LoxLink.
+//
+
+#ifndef LoxRDMController_hpp
+#define LoxRDMController_hpp
+
+#include <stdint.h>
+
+// Remote Device Management (ANSI E1.20) controller. Independent of the hardware:
+// a subclass transmits the packets on the DMX line and reports the found devices.
+
+#define RDM_START_CODE 0xCC
+#define RDM_SUB_START_CODE 0x01
+#define RDM_HEADER_SIZE 24                        // start code up to the parameter data length
+#define RDM_PACKET_MAX (RDM_HEADER_SIZE + 231 + 2) // max. parameter data + checksum
+#define RDM_REPLY_MAX (1 + 8 + RDM_PACKET_MAX)    // break + discovery preamble + packet
+#define RDM_UID_MAX 0xFFFFFFFFFFFEull              // highest UID of a device
+#define RDM_UID_BROADCAST 0xFFFFFFFFFFFFull
+#define RDM_DISCOVERY_DEPTH 50 // binary search over 48 bits: one pending branch per level plus the current split (49), plus one spare
+#define RDM_DISCOVERY_RETRIES 3 // if a single UID answers, but can't be muted
+
+typedef enum {
+  eRDMCommandClass_discovery = 0x10,
+  eRDMCommandClass_get = 0x20,
+  eRDMCommandClass_set = 0x30,
+  eRDMCommandClass_response = 0x01, // added to the command class of the request
+} eRDMCommandClass;
+
+typedef enum {
+  eRDMPID_discUniqueBranch = 0x0001,
+  eRDMPID_discMute = 0x0002,
+  eRDMPID_discUnMute = 0x0003,
+  eRDMPID_dmxStartAddress = 0x00F0,
+} eRDMPID;
+
+typedef enum {
+  eRDMResponseType_ack = 0x00,
+} eRDMResponseType;
+
+class LoxRDMController {
+  struct {
+    uint64_t lower;
+    uint64_t upper;
+  } discoveryStack[RDM_DISCOVERY_DEPTH]; // pending branches of the binary search
+  uint64_t uid;
+  uint8_t transactionNumber;
+  uint8_t packet[RDM_PACKET_MAX];
+  uint8_t reply[RDM_REPLY_MAX];
+
+  int build_packet(uint64_t destination, eRDMCommandClass commandClass, eRDMPID pid, const uint8_t *data, int dataSize);
+  int request(uint64_t destination, eRDMCommandClass commandClass, eRDMPID pid, const uint8_t *data, int dataSize, uint8_t *replyData, int replyDataSize);
+  int disc_unique_branch(uint64_t lower, uint64_t upper, uint64_t &foundUID);
+
+protected:
+  // Send a packet with break and mark after break. If a reply is expected, receive it into the
+  // reply buffer and return the number of bytes (including a leading break), 0 = no reply.
+  virtual int Transact(const uint8_t *packet, int size, uint8_t *reply, int replySize, bool expectReply) = 0;
+  // Called by Discover() for every device, after it was muted. Returns false, if it was already found.
+  virtual bool DeviceFound(uint64_t uid) = 0;
+
+public:
+  LoxRDMController(uint16_t manufacturerID, uint32_t deviceID);
+
+  int Discover(void);
+  void UnmuteAll(void);
+  bool Mute(uint64_t uid);
+  int GetStartAddress(uint64_t uid);
+  bool SetStartAddress(uint64_t uid, uint16_t address);
+};
+
+#endif /* LoxRDMController_hpp */
@@ -63,6 +63,8 @@ const char *const LoxCanMessage::LegacyCommandString(LoxMsgLegacyCommand_t comma
     return "debug";
   case request_statistics:
     return "request_statistics";
+  case monitor_statistics:
+    return "monitor_statistics";
   case air_OtauRxPacket:
     return "air_OtauRxPacket";
   case analog_input_value:
@@ -209,6 +209,11 @@ typedef enum {                   // some of these commands have different meanin
   air_parameter = 0x1B,
   debug = 0x1C,              // send from Miniserver
   request_statistics = 0x1D, // send from Miniserver
+  // send from extension, LoxLink only: runtime statistics in reply to request_statistics. Unknown to the
+  // Miniserver, so it doesn't mistake them for its own statistics. One message per task and interrupt:
+  //   Tasks:      val8 = task index, val16 = CPU load in 0.1%, val32 = stack size << 16 | stack high-water mark (in words, 0xFFFF = overflow)
+  //   Interrupts: val8 = 0x80 + eMonitorISR, val16 = CPU load in 0.1%, val32 = longest run in CPU cycles
+  monitor_statistics = 0x1E,
   air_OtauRxPacket = 0x1F,   // Air Otau packet, see ZWIR4502 documentation
   analog_input_value = 0x20,
   Enocean_config = 0x21,
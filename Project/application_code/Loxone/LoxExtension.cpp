@@ -10,9 +10,6 @@
 #include <assert.h>
 #include <__cross_studio_io.h>
 #include <string.h>
-extern "C" {
-  #include "CryptoCanAlgo.h"
-}
 
 /***
  *  Update the extension state
@@ -35,7 +32,7 @@ void LoxExtension::SetState(eDeviceState state) {
 }
 
 LoxExtension::LoxExtension(LoxCANBaseDriver &driver, uint32_t serial, eDeviceType_t device_type, uint8_t hardware_version, uint32_t version)
-  : driver(driver), serial(serial), device_type(device_type), hardware_version(hardware_version), version(version), state(eDeviceState(-1)) // illegal state to force the SetState() to update
+  : driver(driver), serial(serial), device_type(device_type), hardware_version(hardware_version), version(version), state(eDeviceState(-1)), fragmentSender(driver) // illegal state to force the SetState() to update
 {
   assert(serial != 0);
 #if DEBUG
@@ -46,6 +43,8 @@ LoxExtension::LoxExtension(LoxCANBaseDriver &driver, uint32_t serial, eDeviceTyp
   // the default device ID is the master device ID. Tree devices should override this
   // to return the HAL_GetUID(), which is what real Tree devices do.
   memcpy(this->cryptDeviceID, CryptoMasterDeviceID, sizeof(CryptoMasterDeviceID));
+  CryptoCanAlgo_InitPacketKey(&this->cryptInitKey, this->serial);
+  memset(&this->cryptSessionKey, 0, sizeof(this->cryptSessionKey)); // no challenge solved yet
 
   driver.AddExtension(this);
 }
\ No newline at end of file
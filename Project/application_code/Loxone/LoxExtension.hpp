@@ -10,6 +10,10 @@
 
 #include "LoxCANBaseDriver.hpp"
 #include "LoxCanMessage.hpp"
+#include "LoxFragmentSender.hpp"
+extern "C" {
+  #include "CryptoCanAlgo.h"
+}
 
 // The different state, in which the extension can be
 typedef enum {
@@ -30,10 +34,11 @@ public:
 protected:
   LoxCANBaseDriver &driver;
   eDeviceState state;
+  LoxFragmentSender fragmentSender; // for legacy and NAT fragmented messages
 
-  // authorization and encryption
-  uint32_t cryptAesKey[4];
-  uint32_t cryptAesIV;
+  // authorization and encryption, the keys are expanded once
+  tCryptoCanAlgoKey cryptInitKey;    // for init packets, derived from the serial
+  tCryptoCanAlgoKey cryptSessionKey; // for data packets, derived from the last challenge
   uint8_t cryptDeviceID[12];
 
   virtual void SetState(eDeviceState state);
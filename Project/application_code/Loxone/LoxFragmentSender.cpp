@@ -0,0 +1,110 @@
+//
+//  LoxFragmentSender.cpp
+//
+//  Part of LoxLink.
+//
+
+#include "LoxFragmentSender.hpp"
+#include <__cross_studio_io.h>
+#include <string.h>
+
+/***
+ *  Constructor
+ ***/
+LoxFragmentSender::LoxFragmentSender(LoxCANBaseDriver &driver)
+  : driver(driver), buffer1(NULL), byteCount1(0), buffer2(NULL), byteCount2(0), aborted(false) {
+  ctl_mutex_init(&this->mutex);
+}
+
+/***
+ *  Register the payload of the next fragmented message
+ ***/
+void LoxFragmentSender::Begin(const void *buffer1, uint32_t byteCount1, const void *buffer2, uint32_t byteCount2) {
+  ctl_mutex_lock(&this->mutex, CTL_TIMEOUT_NONE, 0);
+  this->buffer1 = (const uint8_t *)buffer1;
+  this->byteCount1 = byteCount1;
+  this->buffer2 = (const uint8_t *)buffer2;
+  this->byteCount2 = byteCount2;
+  this->aborted = false;
+}
+
+void LoxFragmentSender::End(void) {
+  this->buffer1 = this->buffer2 = NULL;
+  this->byteCount1 = this->byteCount2 = 0;
+  ctl_mutex_unlock(&this->mutex);
+}
+
+/***
+ *  Copy bytes out of the two consecutive buffers, starting at offset
+ ***/
+void LoxFragmentSender::copy(uint8_t *dest, uint32_t offset, int count) const {
+  if (offset < this->byteCount1) {
+    int n = this->byteCount1 - offset;
+    if (n > count)
+      n = count;
+    memmove(dest, this->buffer1 + offset, n);
+    dest += n;
+    offset += n;
+    count -= n;
+  }
+  if (count > 0)
+    memmove(dest, this->buffer2 + (offset - this->byteCount1), count);
+}
+
+/***
+ *  Sum of all bytes of the payload
+ ***/
+uint16_t LoxFragmentSender::Checksum(void) const {
+  uint16_t checksum = 0x0000;
+  for (uint32_t i = 0; i < this->byteCount1; ++i)
+    checksum += this->buffer1[i];
+  for (uint32_t i = 0; i < this->byteCount2; ++i)
+    checksum += this->buffer2[i];
+  return checksum;
+}
+
+/***
+ *  Wait till the transmit queue has space for another package. Returns false, if the
+ *  queue doesn't drain, e.g. because the bus is down. The rest of the message is dropped then.
+ ***/
+bool LoxFragmentSender::wait_for_queue(void) {
+  if (!this->aborted and !this->driver.WaitTransmitQueue(FRAGMENT_SENDER_QUEUE_LEVEL, FRAGMENT_SENDER_TIMEOUT_MS)) {
+#if DEBUG
+    debug_printf("Fragment aborted, transmit queue full\n");
+#endif
+    this->aborted = true;
+  }
+  return !this->aborted;
+}
+
+/***
+ *  Send a single message of the fragmented message
+ ***/
+void LoxFragmentSender::Send(LoxCanMessage &message) {
+  if (wait_for_queue())
+    this->driver.SendMessage(message);
+}
+
+/***
+ *  Send the payload in packages of 6 or 7 bytes. Each package is copied directly from the
+ *  payload into the message, once the transmit queue has space for it.
+ ***/
+void LoxFragmentSender::SendData(const LoxCanMessage &message, eFragmentPackage package) {
+  int dataOffset = (package == eFragmentPackage_indexed) ? 1 : 0;
+  int packageSize = sizeof(message.data) - dataOffset;
+  uint32_t byteCount = Size();
+  uint8_t packageIndex = 0;
+  for (uint32_t offset = 0; offset < byteCount; offset += packageSize) {
+    LoxCanMessage msg = message; // the driver is allowed to modify the message
+    int count = byteCount - offset;
+    if (count > packageSize)
+      count = packageSize;
+    if (package == eFragmentPackage_indexed)
+      msg.data[0] = ++packageIndex;
+    memset(&msg.data[dataOffset], 0, packageSize); // no garbage after the last byte
+    copy(&msg.data[dataOffset], offset, count);
+    Send(msg);
+    if (this->aborted)
+      break;
+  }
+}
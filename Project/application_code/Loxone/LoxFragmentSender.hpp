@@ -0,0 +1,55 @@
+//
+//  LoxFragmentSender.hpp
+//
+//  Part of LoxLink.
+//
+
+#ifndef LoxFragmentSender_hpp
+#define LoxFragmentSender_hpp
+
+#include "LoxCANBaseDriver.hpp"
+#include "LoxCanMessage.hpp"
+
+#define FRAGMENT_SENDER_QUEUE_LEVEL 48  // max. number of messages in the transmit queue, the rest is kept free for other messages
+#define FRAGMENT_SENDER_TIMEOUT_MS 1000 // give up, if the transmit queue doesn't drain
+
+// Layout of the data packages of a fragmented message
+typedef enum {
+  eFragmentPackage_indexed, // legacy: package index (starting with 1) followed by 6 bytes of data
+  eFragmentPackage_plain,   // large legacy and NAT: 7 bytes of data
+} eFragmentPackage;
+
+/***
+ *  Sends the packages of fragmented messages, legacy or NAT. The packages are only
+ *  handed to the driver if there is space in the transmit queue, otherwise the calling
+ *  task sleeps till the CAN TX task signals, that a message was sent. The payload can be split into two buffers, e.g. for a ring buffer.
+ ***/
+class LoxFragmentSender {
+  LoxCANBaseDriver &driver;
+  CTL_MUTEX_t mutex; // one fragmented message at a time
+  const uint8_t *buffer1;
+  uint32_t byteCount1;
+  const uint8_t *buffer2;
+  uint32_t byteCount2;
+  bool aborted;
+
+  void copy(uint8_t *dest, uint32_t offset, int count) const;
+  bool wait_for_queue(void);
+
+public:
+  LoxFragmentSender(LoxCANBaseDriver &driver);
+
+  // register the payload and lock the sender till End() is called
+  void Begin(const void *buffer1, uint32_t byteCount1, const void *buffer2 = 0, uint32_t byteCount2 = 0);
+  void End(void);
+
+  uint32_t Size(void) const { return this->byteCount1 + this->byteCount2; };
+  uint16_t Checksum(void) const; // byte checksum over the payload
+
+  // send a single message, e.g. the header
+  void Send(LoxCanMessage &message);
+  // send the payload, the message has to be prepared with the command of the data packages
+  void SendData(const LoxCanMessage &message, eFragmentPackage package);
+};
+
+#endif /* LoxFragmentSender_hpp */
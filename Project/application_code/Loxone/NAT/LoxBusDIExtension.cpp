@@ -6,6 +6,7 @@
 //
 
 #include "LoxBusDIExtension.hpp"
+#include "Monitor.hpp"
 #include "global_functions.hpp"
 #include "stm32f1xx_hal_cortex.h"
 #include "stm32f1xx_hal_dma.h"
@@ -13,6 +14,13 @@
 #include "stm32f1xx_hal_rcc.h"
 #include "stm32f1xx_hal_tim.h"
 #include <stdio.h>
+#include <string.h>
+
+// The inputs are wired, so that all of them can be gathered with two port reads:
+// PE0..PE15 are the inputs 0..15, PC0..PC3 are the inputs 16..19
+#define DI_GPIOE_MASK 0xFFFF
+#define DI_GPIOC_MASK 0x000F
+#define DI_GPIOC_SHIFT 16
 
 static const struct {
   uint16_t pin;
@@ -42,42 +50,166 @@ static const struct {
 
 TIM_HandleTypeDef g1000HzTimer;
 LoxBusDIExtension *gDIExt;
+static uint8_t gDIExtiInput[16]; // input for each EXTI line, 0xFF = line not used
 
-extern "C" void TIM3_IRQHandler(void) {
-  HAL_TIM_IRQHandler(&g1000HzTimer);
+/***
+ *  Read all 20 inputs as a bitmask
+ ***/
+static inline uint32_t di_read_inputs(void) {
+  return (GPIOE->IDR & DI_GPIOE_MASK) | ((GPIOC->IDR & DI_GPIOC_MASK) << DI_GPIOC_SHIFT);
 }
 
-extern "C" void HAL_TIM_PeriodElapsedCallback(TIM_HandleTypeDef *htim) {
-  if (htim->Instance == TIM3) {
-    static volatile uint32_t sMillisecondsCounter;
-    uint32_t gpioBits = 0;
-    for (int i = 0; i < DI_EXTENSION_INPUTS; ++i) {
-      GPIO_PinState state = HAL_GPIO_ReadPin(gDIPins[i].gpio, gDIPins[i].pin);
-      if (gDIExt->config.frequencyInputsBitmask & (1 << i)) { // is this pin a frequency counter?
-        if (state != gDIExt->hardwareFrequencyStates[i].state) {
-          gDIExt->hardwareFrequencyStates[i].state = state;
-          gDIExt->hardwareFrequencyStates[i].impulseCounter++; // count every change of a flank
-        }
-      } else { // regular (non-frequency) input
-        if (state == GPIO_PIN_SET)
-          gpioBits |= 1 << i;
-      }
-      // once a second transfer the frequency counter into the frequency and reset the counter
-      if (sMillisecondsCounter == 0) {
-        gDIExt->hardwareFrequencyStates[i].frequencyHz = gDIExt->hardwareFrequencyStates[i].impulseCounter;
-        gDIExt->hardwareFrequencyStates[i].impulseCounter = 0;
-      }
+/***
+ *  Timestamp a rising edge of a frequency input. The DWT cycle counter is enabled by monitor_init().
+ ***/
+static inline void di_frequency_edge(LoxBusDIExtension *ext, int input, uint32_t cycles) {
+  if (ext->hardwareFrequencyStates[input].edgeCount and cycles - ext->hardwareFrequencyStates[input].lastEdgeCycles < ext->hardwareFrequencyHoldoffCycles)
+    return; // bouncing contact
+  if (ext->hardwareFrequencyStates[input].edgeCount++ == 0)
+    ext->hardwareFrequencyStates[input].firstEdgeCycles = cycles;
+  ext->hardwareFrequencyStates[input].lastEdgeCycles = cycles;
+}
+
+/***
+ *  Debounce all inputs at once with 2-bit vertical counters: an input only changes its debounced
+ *  state after it had the new value for DI_DEBOUNCE_SAMPLES consecutive samples of its class.
+ ***/
+static inline uint32_t di_debounce_inputs(LoxBusDIExtension *ext, uint32_t inputs) {
+  uint32_t state = ext->debouncedInputBits;
+  uint32_t tick = ext->hardwareSampleCounter++;
+  for (int c = 0; c < DI_DEBOUNCE_CLASSES; ++c) {
+    if (tick & ((1u << c) - 1)) // classes > 0 only sample every 2^c ticks
+      break;
+    if (!ext->debounceClasses[c].mask)
+      continue;
+    uint32_t delta = (inputs ^ state) & ext->debounceClasses[c].mask;
+    uint32_t ct0 = ~(ext->debounceClasses[c].ct0 & delta);   // reset or count the low bit
+    uint32_t ct1 = ct0 ^ (ext->debounceClasses[c].ct1 & delta); // reset or count the high bit
+    ext->debounceClasses[c].ct0 = ct0;
+    ext->debounceClasses[c].ct1 = ct1;
+    state ^= delta & ct0 & ct1; // counter rolled over => accept the new state
+  }
+  state = (state & ~ext->debounceNoneMask) | (inputs & ext->debounceNoneMask);
+  ext->debouncedInputBits = state;
+  return state;
+}
+
+/***
+ *  Unmask the EXTI lines, which ran out of their budget in the last tick. Their measurement
+ *  restarts, because edges were missed while they were masked.
+ ***/
+static void di_exti_rearm(LoxBusDIExtension *ext) {
+  ext->hardwareExtiEdges = 0;
+  uint32_t masked = ext->hardwareExtiLines & ~EXTI->IMR;
+  if (!masked)
+    return;
+  for (uint32_t lines = masked; lines;) {
+    int line = 31 - __CLZ(lines);
+    lines &= ~(1u << line);
+    ext->hardwareFrequencyStates[gDIExtiInput[line]].edgeCount = 0;
+  }
+  EXTI->PR = masked;
+  EXTI->IMR |= masked;
+}
+
+/***
+ *  Sample all inputs, called with DI_SAMPLE_RATE_HZ from the TIM3 interrupt
+ ***/
+static void di_scan_inputs(LoxBusDIExtension *ext) {
+  di_exti_rearm(ext);
+  uint32_t inputs = di_read_inputs();
+  uint32_t risingEdges = (inputs ^ ext->hardwareInputBits) & inputs & ext->hardwarePolledFrequencyMask;
+  ext->hardwareInputBits = inputs;
+  uint32_t bitmask = di_debounce_inputs(ext, inputs) & ~ext->config.frequencyInputsBitmask;
+  uint32_t changed = bitmask ^ ext->hardwareBitmask;
+  ext->hardwareBitmask = bitmask;
+  if (changed) { // queue every change, so even short pulses reach the Miniserver
+    uint32_t head = ext->eventQueueHead;
+    if (head - ext->eventQueueTail < DI_EVENT_QUEUE_SIZE) {
+      tDIEvent &event = ext->eventQueue[head & (DI_EVENT_QUEUE_SIZE - 1)];
+      event.timestamp = ctl_get_current_time();
+      event.changed = changed;
+      event.state = bitmask;
+      __DMB(); // the event has to be written before the head moves
+      ext->eventQueueHead = head + 1;
+    } else {
+      ext->eventQueueOverflow = true;
+    }
+  }
+  if (risingEdges) { // frequency inputs, which could not be routed to an EXTI line
+    uint32_t cycles = DWT->CYCCNT;
+    while (risingEdges) {
+      int i = 31 - __CLZ(risingEdges);
+      risingEdges &= ~(1u << i);
+      di_frequency_edge(ext, i, cycles);
+    }
+  }
+}
+
+/***
+ *  All EXTI lines share this handler: timestamp the rising edges of the frequency inputs.
+ *  After DI_EXTI_MAX_EDGES_PER_TICK edges all lines are masked until the next TIM3 tick.
+ ***/
+static void di_exti_irq(void) {
+  MONITOR_ISR_ENTER();
+  uint32_t cycles = DWT->CYCCNT;
+  uint32_t pending = EXTI->PR & EXTI->IMR & 0xFFFF;
+  EXTI->PR = pending;
+  while (pending) {
+    int line = 31 - __CLZ(pending);
+    pending &= ~(1u << line);
+    if (gDIExtiInput[line] != 0xFF) {
+      di_frequency_edge(gDIExt, gDIExtiInput[line], cycles);
+      ++gDIExt->hardwareExtiEdges;
     }
-    gDIExt->hardwareBitmask = gpioBits;
-    sMillisecondsCounter++;
-    if (sMillisecondsCounter >= 1000) // reset every second
-      sMillisecondsCounter = 0;
   }
+  if (gDIExt->hardwareExtiEdges >= DI_EXTI_MAX_EDGES_PER_TICK)
+    EXTI->IMR &= ~gDIExt->hardwareExtiLines;
+  MONITOR_ISR_LEAVE(eMonitorISR_EXTI);
+}
+
+extern "C" void EXTI0_IRQHandler(void) {
+  di_exti_irq();
+}
+
+extern "C" void EXTI1_IRQHandler(void) {
+  di_exti_irq();
+}
+
+extern "C" void EXTI2_IRQHandler(void) {
+  di_exti_irq();
+}
+
+extern "C" void EXTI3_IRQHandler(void) {
+  di_exti_irq();
+}
+
+extern "C" void EXTI4_IRQHandler(void) {
+  di_exti_irq();
+}
+
+extern "C" void EXTI9_5_IRQHandler(void) {
+  di_exti_irq();
+}
+
+extern "C" void EXTI15_10_IRQHandler(void) {
+  di_exti_irq();
+}
+
+extern "C" void TIM3_IRQHandler(void) {
+  MONITOR_ISR_ENTER();
+  // only the update interrupt is enabled, avoid the overhead of HAL_TIM_IRQHandler()
+  if (TIM3->SR & TIM_SR_UIF) {
+    TIM3->SR = ~TIM_SR_UIF;
+    di_scan_inputs(gDIExt);
+  }
+  MONITOR_ISR_LEAVE(eMonitorISR_TIM3);
 }
 
 LoxBusDIExtension::LoxBusDIExtension(LoxCANBaseDriver &driver, uint32_t serial, eAliveReason_t alive)
-  : LoxNATExtension(driver, (serial & 0xFFFFFF) | (eDeviceType_t_DIExtension << 24), eDeviceType_t_DIExtension, 0, 10031108, 1, sizeof(config), &config, alive), hardwareBitmask(0), lastBitmaskSendTime(0), lastBitmaskSend(0), lastFrequencyTime(0) {
+  : LoxNATExtension(driver, (serial & 0xFFFFFF) | (eDeviceType_t_DIExtension << 24), eDeviceType_t_DIExtension, 0, 10031108, 1, sizeof(config), &config, alive), hardwareBitmask(0), hardwareInputBits(0), hardwarePolledFrequencyMask(0), hardwareExtiLines(0), hardwareExtiEdges(0), hardwareFrequencyHoldoffCycles(0), hardwareSampleCounter(0), debounceNoneMask(0), debouncedInputBits(0), eventQueueHead(0), eventQueueTail(0), eventQueueOverflow(false), lastBitmaskSend(0), lastFrequencyTime(0) {
   gDIExt = this;
+  memset(this->debounceClasses, 0, sizeof(this->debounceClasses));
 }
 
 void LoxBusDIExtension::Startup(void) {
@@ -94,9 +226,15 @@ void LoxBusDIExtension::Startup(void) {
     HAL_GPIO_Init(gDIPins[i].gpio, &GPIO_Init);
   }
 
+  this->hardwareInputBits = di_read_inputs();
+  this->debouncedInputBits = this->hardwareInputBits;
+  this->hardwareBitmask = this->hardwareInputBits & ~this->config.frequencyInputsBitmask;
+  DebounceSetup();
+
+  // TIM3 is clocked with 2x PCLK1, because APB1 is divided by 2
   g1000HzTimer.Instance = TIM3;
-  g1000HzTimer.Init.Prescaler = HAL_RCC_GetPCLK1Freq() / 2000 - 1;
-  g1000HzTimer.Init.Period = 2 - 1; // 2000HZ / 2 = 1000Hz
+  g1000HzTimer.Init.Prescaler = 2 * HAL_RCC_GetPCLK1Freq() / (2 * DI_SAMPLE_RATE_HZ) - 1;
+  g1000HzTimer.Init.Period = 2 - 1; // (2 * DI_SAMPLE_RATE_HZ) / 2 = DI_SAMPLE_RATE_HZ
 
   __HAL_RCC_TIM3_CLK_ENABLE();
   HAL_NVIC_SetPriority(TIM3_IRQn, 0, 0);
@@ -104,6 +242,134 @@ void LoxBusDIExtension::Startup(void) {
 
   HAL_TIM_Base_Init(&g1000HzTimer);
   HAL_TIM_Base_Start_IT(&g1000HzTimer);
+
+  static const IRQn_Type extiIRQs[] = {EXTI0_IRQn, EXTI1_IRQn, EXTI2_IRQn, EXTI3_IRQn, EXTI4_IRQn, EXTI9_5_IRQn, EXTI15_10_IRQn};
+  for (unsigned i = 0; i < sizeof(extiIRQs) / sizeof(extiIRQs[0]); ++i) {
+    HAL_NVIC_SetPriority(extiIRQs[i], 0, 0);
+    HAL_NVIC_EnableIRQ(extiIRQs[i]);
+  }
+  FrequencySetup();
+}
+
+/***
+ *  Assign every input to the debounce class matching its debounce time. Frequency inputs are not
+ *  debounced, they only use the hold-off time, because debouncing would limit their frequency.
+ ***/
+void LoxBusDIExtension::DebounceSetup(void) {
+  uint32_t classMasks[DI_DEBOUNCE_CLASSES] = {0};
+  uint32_t noneMask = 0;
+  const uint32_t samplesPerMs = DI_SAMPLE_RATE_HZ / 1000;
+  for (int i = 0; i < DI_EXTENSION_INPUTS; ++i) {
+    uint32_t samples = DI_DEBOUNCE_MS * samplesPerMs;
+    if (samples == 0 or (this->config.frequencyInputsBitmask & (1u << i))) {
+      noneMask |= 1u << i;
+      continue;
+    }
+    int c = 0;
+    while (c < DI_DEBOUNCE_CLASSES - 1 and (uint32_t(DI_DEBOUNCE_SAMPLES) << c) < samples)
+      ++c;
+    classMasks[c] |= 1u << i;
+  }
+  int en = ctl_global_interrupts_disable();
+  for (int c = 0; c < DI_DEBOUNCE_CLASSES; ++c) {
+    this->debounceClasses[c].mask = classMasks[c];
+    this->debounceClasses[c].ct0 = ~0u;
+    this->debounceClasses[c].ct1 = ~0u;
+  }
+  this->debounceNoneMask = noneMask;
+  this->hardwareFrequencyHoldoffCycles = DI_FREQUENCY_HOLDOFF_MS * (SystemCoreClock / 1000);
+  ctl_global_interrupts_set(en);
+}
+
+/***
+ *  Route the frequency inputs to EXTI lines. Each EXTI line can only be connected to one port,
+ *  so PC0..PC3 share their lines with PE0..PE3. If both inputs of a line are frequency inputs,
+ *  PC0..PC3 are timestamped by the TIM3 scan instead, which limits them to DI_SAMPLE_RATE_HZ/2
+ *  (500Hz). All other frequency inputs use an EXTI line.
+ ***/
+void LoxBusDIExtension::FrequencySetup(void) {
+  uint32_t frequencyMask = this->config.frequencyInputsBitmask;
+  uint32_t extiLines = 0;
+  uint32_t polledMask = 0;
+
+  this->hardwareExtiLines = 0; // first, so the TIM3 IRQ does not unmask the lines again
+  EXTI->IMR &= ~0xFFFF;
+  EXTI->RTSR &= ~0xFFFF;
+  EXTI->FTSR &= ~0xFFFF;
+  memset(gDIExtiInput, 0xFF, sizeof(gDIExtiInput));
+  for (int i = 0; i < DI_EXTENSION_INPUTS; ++i) {
+    if (!(frequencyMask & (1u << i)))
+      continue;
+    int line = 31 - __CLZ(gDIPins[i].pin);
+    if (extiLines & (1u << line)) { // line already used by another port
+      polledMask |= 1u << i;
+      continue;
+    }
+    extiLines |= 1u << line;
+    gDIExtiInput[line] = i;
+    uint32_t shift = 4 * (line & 3);
+    AFIO->EXTICR[line >> 2] = (AFIO->EXTICR[line >> 2] & ~(0xFu << shift)) | (GPIO_GET_INDEX(gDIPins[i].gpio) << shift);
+  }
+
+  uint32_t now = DWT->CYCCNT;
+  for (int i = 0; i < DI_EXTENSION_INPUTS; ++i) {
+    this->hardwareFrequencyStates[i].edgeCount = 0;
+    this->hardwareFrequencyStates[i].frequencyMilliHz = 0;
+    this->hardwareFrequencyStates[i].zeroHzSent = false;
+    this->frequencyGateStart[i] = now;
+  }
+  this->hardwarePolledFrequencyMask = polledMask;
+  this->hardwareExtiLines = extiLines;
+  EXTI->PR = extiLines;
+  EXTI->RTSR |= extiLines;
+  EXTI->IMR |= extiLines;
+}
+
+/***
+ *  Reciprocal frequency measurement: the frequency is the number of periods between the first
+ *  and the last edge in the gate divided by their time difference. The gate is at least
+ *  DI_FREQUENCY_MIN_GATE_MS long and is extended up to DI_FREQUENCY_MAX_GATE_MS, until two edges
+ *  arrived, so slow pulses (S0 meters) are measured as well. The measurement is kept in mHz, but
+ *  the Miniserver only receives whole Hz (see Timer10ms()).
+ ***/
+void LoxBusDIExtension::FrequencyUpdate(void) {
+  const uint32_t cyclesPerMs = SystemCoreClock / 1000;
+  uint32_t now = DWT->CYCCNT;
+  uint32_t frequencyMask = this->config.frequencyInputsBitmask;
+  while (frequencyMask) {
+    int i = 31 - __CLZ(frequencyMask);
+    frequencyMask &= ~(1u << i);
+    uint32_t gateTime = now - this->frequencyGateStart[i];
+    if (gateTime < DI_FREQUENCY_MIN_GATE_MS * cyclesPerMs)
+      continue;
+
+    int en = ctl_global_interrupts_disable();
+    now = DWT->CYCCNT; // sample again with interrupts disabled, so no edge can be later than now
+    uint32_t edges = this->hardwareFrequencyStates[i].edgeCount;
+    uint32_t firstEdge = this->hardwareFrequencyStates[i].firstEdgeCycles;
+    uint32_t lastEdge = this->hardwareFrequencyStates[i].lastEdgeCycles;
+    if (edges >= 2) { // the next gate starts with the last edge of this one, so no period is lost
+      this->hardwareFrequencyStates[i].edgeCount = 1;
+      this->hardwareFrequencyStates[i].firstEdgeCycles = lastEdge;
+    } else if (gateTime >= DI_FREQUENCY_MAX_GATE_MS * cyclesPerMs) {
+      if (edges == 1 && now - firstEdge >= DI_FREQUENCY_MAX_GATE_MS * cyclesPerMs)
+        this->hardwareFrequencyStates[i].edgeCount = 0; // too old to be used as the start of a period
+    }
+    ctl_global_interrupts_set(en);
+
+    if (edges >= 2 && lastEdge != firstEdge) {
+      this->hardwareFrequencyStates[i].frequencyMilliHz = uint64_t(edges - 1) * SystemCoreClock * 1000 / (lastEdge - firstEdge);
+      this->frequencyGateStart[i] = now;
+    } else if (gateTime >= DI_FREQUENCY_MAX_GATE_MS * cyclesPerMs) {
+      this->hardwareFrequencyStates[i].frequencyMilliHz = 0;
+      this->frequencyGateStart[i] = now;
+    } else if (edges == 1 && now != lastEdge) {
+      // while waiting for the next edge, the frequency can not be higher than 1/(time since the last edge)
+      uint32_t maxMilliHz = uint64_t(SystemCoreClock) * 1000 / (now - lastEdge);
+      if (this->hardwareFrequencyStates[i].frequencyMilliHz > maxMilliHz)
+        this->hardwareFrequencyStates[i].frequencyMilliHz = maxMilliHz;
+    }
+  }
 }
 
 /***
@@ -111,18 +377,45 @@ void LoxBusDIExtension::Startup(void) {
  *  to provide the Miniserver with the current value after a reboot.
  ***/
 void LoxBusDIExtension::SendValues() {
-  // read all gpio bits
-  uint32_t gpioBits = 0;
-  for (int i = 0; i < DI_EXTENSION_INPUTS; ++i) {
-    GPIO_PinState state = HAL_GPIO_ReadPin(gDIPins[i].gpio, gDIPins[i].pin);
-    if (this->config.frequencyInputsBitmask & (1 << i)) // is this pin a frequency counter?
-      continue;
-    // regular (non-frequency) input
-    if (state == GPIO_PIN_SET)
-      gpioBits |= 1 << i;
+  this->lastBitmaskSend = this->hardwareBitmask;
+  send_digital_value(0, this->lastBitmaskSend);
+}
+
+/***
+ *  Send all queued input changes in order. If the CAN bus is congested, consecutive changes are merged
+ *  as long as no input changes twice, so every transition of every input still reaches the Miniserver.
+ *  The transmit queue is checked before every message, because this loop can fill it by itself.
+ ***/
+void LoxBusDIExtension::SendEvents(void) {
+  uint32_t head = this->eventQueueHead;
+  __DMB(); // read the head before the events
+  uint32_t tail = this->eventQueueTail;
+  while (tail != head) {
+    const tDIEvent &event = this->eventQueue[tail++ & (DI_EVENT_QUEUE_SIZE - 1)];
+    uint32_t state = event.state;
+    if (driver.GetTransmitQueueCount() >= DI_EVENT_CONGESTION_LEVEL) {
+      uint32_t changed = event.changed;
+      while (tail != head) {
+        const tDIEvent &next = this->eventQueue[tail & (DI_EVENT_QUEUE_SIZE - 1)];
+        if (next.changed & changed) // an input would toggle twice, this needs a separate message
+          break;
+        changed |= next.changed;
+        state = next.state;
+        ++tail;
+      }
+    }
+    if (state != this->lastBitmaskSend) {
+      this->lastBitmaskSend = state;
+      send_digital_value(0, state);
+    }
+  }
+  this->eventQueueTail = tail;
+
+  if (this->eventQueueOverflow) { // changes were lost, at least send the current state
+    this->eventQueueOverflow = false;
+    if (this->lastBitmaskSend != this->hardwareBitmask)
+      SendValues();
   }
-  this->hardwareBitmask = gpioBits;
-  send_digital_value(0, this->hardwareBitmask);
 }
 
 /***
@@ -130,6 +423,16 @@ void LoxBusDIExtension::SendValues() {
  ***/
 void LoxBusDIExtension::ConfigUpdate(void) {
   //debug_printf("Config updated: 0x%04x\n", this->config.frequencyInputsBitmask);
+  DebounceSetup();
+  FrequencySetup();
+}
+
+/***
+ *  The configuration was reset, no frequency inputs
+ ***/
+void LoxBusDIExtension::ConfigLoadDefaults(void) {
+  DebounceSetup();
+  FrequencySetup();
 }
 
 /***
@@ -138,11 +441,13 @@ void LoxBusDIExtension::ConfigUpdate(void) {
 void LoxBusDIExtension::Timer10ms(void) {
   LoxNATExtension::Timer10ms();
 
+  FrequencyUpdate();
   if (this->lastFrequencyTime >= 1000) { // frequencies are sent once per second
     this->lastFrequencyTime = 0;
     for (int i = 0; i < DI_EXTENSION_INPUTS; ++i) {
       if (this->config.frequencyInputsBitmask & (1 << i)) { // is this pin a frequency counter?
-        uint16_t freq = this->hardwareFrequencyStates[i].frequencyHz;
+        // The Miniserver expects whole Hz, so the resolution is 1Hz and below 0.5Hz 0Hz is sent
+        uint32_t freq = (this->hardwareFrequencyStates[i].frequencyMilliHz + 500) / 1000;
         if (freq) {
           send_frequency_value(i, freq);
           this->hardwareFrequencyStates[i].zeroHzSent = false;
@@ -158,14 +463,5 @@ void LoxBusDIExtension::Timer10ms(void) {
   }
   this->lastFrequencyTime += 10;
 
-  // simulate the inputs changing every second. They are sent back on every value change,
-  // but not faster than 20ms (= 50Hz)
-  if ((this->lastBitmaskSendTime % 50) == 0) { // throttle to 50Hz
-    if (this->lastBitmaskSend != this->hardwareBitmask) {
-      this->lastBitmaskSend = this->hardwareBitmask;
-      this->lastBitmaskSendTime = 0;
-      send_digital_value(0, this->lastBitmaskSend);
-    }
-  }
-  this->lastBitmaskSendTime += 10;
+  SendEvents();
 }
\ No newline at end of file
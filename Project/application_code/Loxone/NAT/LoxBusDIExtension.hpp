@@ -14,6 +14,20 @@
 #include "stm32f1xx_hal_tim.h"
 
 #define DI_EXTENSION_INPUTS 20
+#define DI_SAMPLE_RATE_HZ 1000 // sample rate of the inputs, TIM3 interrupt frequency
+#define DI_FREQUENCY_MIN_GATE_MS 1000  // shortest measurement window for a frequency
+#define DI_FREQUENCY_MAX_GATE_MS 30000 // no 2nd edge within this window => 0Hz. Has to be below the DWT wrap-around (~59s)
+// CPU budget of the EXTI interrupt: an edge costs roughly 100 cycles with the interrupt entry and exit,
+// so 32 edges per TIM3 tick are about 5% of the CPU at 72MHz. Above this, the EXTI lines stay masked
+// until the next tick and the measurement restarts, so fast inputs are measured in short windows.
+#define DI_EXTI_MAX_EDGES_PER_TICK 32
+#define DI_EVENT_QUEUE_SIZE 64         // number of input changes buffered between two 10ms ticks, has to be a power of 2
+#define DI_EVENT_CONGESTION_LEVEL 16   // coalesce input changes, if this many messages are waiting in the CAN transmit queue
+#define DI_DEBOUNCE_SAMPLES 4          // a 2-bit vertical counter needs 4 identical samples to accept a change
+#define DI_DEBOUNCE_CLASSES 5          // debounce times of 4, 8, 16, 32 and 64 samples
+// The Miniserver has no setting for these, they are fixed at compile time
+#define DI_DEBOUNCE_MS 4          // debounce time of the digital inputs, 0 = no debounce. Rounded up to 4, 8, 16, 32 or 64ms
+#define DI_FREQUENCY_HOLDOFF_MS 0 // edges of frequency inputs are ignored for this time after an edge, 0 = off
 
 class tDIExtensionConfig : public tConfigHeader {
 public:
@@ -22,24 +36,56 @@ private:
   tConfigHeaderFiller filler;
 };
 
+// A change of the digital inputs, recorded by the TIM3 IRQ
+typedef struct {
+  CTL_TIME_t timestamp; // time of the change in ms
+  uint32_t changed;     // bitmask of the inputs which changed
+  uint32_t state;       // state of all digital inputs after the change
+} tDIEvent;
+
 class LoxBusDIExtension : public LoxNATExtension {
 public:
-  // used by the TIM3 IRQ
+  // used by the TIM3 and EXTI IRQs
   volatile uint32_t hardwareBitmask;
+  volatile uint32_t hardwareInputBits;           // last sampled state of all inputs, used for edge detection
+  volatile uint32_t hardwarePolledFrequencyMask; // frequency inputs without an EXTI line, their edges are timestamped by the TIM3 scan
+  volatile uint32_t hardwareExtiLines;           // EXTI lines used by frequency inputs
+  volatile uint32_t hardwareExtiEdges;           // EXTI edges in the current TIM3 tick
+  volatile uint32_t hardwareFrequencyHoldoffCycles;
+  volatile uint32_t hardwareSampleCounter;
+  struct {            // bit-parallel debounce, each class samples every 2^class ticks
+    uint32_t mask;    // inputs debounced by this class
+    uint32_t ct0;     // low bit of the vertical counter
+    uint32_t ct1;     // high bit of the vertical counter
+  } debounceClasses[DI_DEBOUNCE_CLASSES];
+  volatile uint32_t debounceNoneMask; // inputs without debounce
+  uint32_t debouncedInputBits;
   volatile struct {
-    GPIO_PinState state;
     bool zeroHzSent;
-    uint16_t impulseCounter;
-    uint16_t frequencyHz;
+    uint32_t edgeCount;       // number of rising edges in the current gate
+    uint32_t firstEdgeCycles; // DWT timestamp of the first edge in the gate
+    uint32_t lastEdgeCycles;  // DWT timestamp of the latest edge
+    uint32_t frequencyMilliHz;
   } hardwareFrequencyStates[DI_EXTENSION_INPUTS];
+  // single producer (TIM3 IRQ), single consumer (10ms timer) ring buffer, no locking necessary
+  tDIEvent eventQueue[DI_EVENT_QUEUE_SIZE];
+  volatile uint32_t eventQueueHead; // only written by the IRQ
+  volatile uint32_t eventQueueTail; // only written by the 10ms timer
+  volatile bool eventQueueOverflow;
   tDIExtensionConfig config;
 
 private:
-  uint32_t lastBitmaskSendTime;
   uint32_t lastBitmaskSend;
   uint32_t lastFrequencyTime;
+  uint32_t frequencyGateStart[DI_EXTENSION_INPUTS]; // DWT timestamp, when the current gate was opened
+
+  void DebounceSetup(void);
+  void FrequencySetup(void);
+  void FrequencyUpdate(void);
+  void SendEvents(void);
 
   virtual void ConfigUpdate(void);
+  virtual void ConfigLoadDefaults(void);
   virtual void SendValues();
 
 public:
@@ -8,6 +8,7 @@
 #include "LoxNATExtension.hpp"
 #include "LED.hpp"
 #include "LoxCANBaseDriver.hpp"
+#include "Monitor.hpp"
 #include "global_functions.hpp"
 extern "C" {
   #include "CryptoCanAlgo.h"
@@ -45,6 +46,17 @@ void LoxNATExtension::send_special_message(LoxMsgNATCommand_t command) {
   }
 }
 
+/***
+ *  Fill in the addressing of a package from this extension
+ ***/
+void LoxNATExtension::prepare_package(LoxMsgNATCommand_t command, LoxCanMessage &msg) {
+  msg.deviceNAT = driver.isLoxoneLinkBusDriver() ? this->deviceNAT : this->extensionNAT;
+  msg.commandNat = command;
+  msg.extensionNat = this->extensionNAT;
+  msg.directionNat = LoxCmdNATDirection_t_fromDevice;
+  msg.busType = this->busType;
+}
+
 /***
  *  Send regular package, but only if a NAT has been assigned to the extension
  ***/
@@ -52,10 +64,8 @@ void LoxNATExtension::lox_send_package_if_nat(LoxMsgNATCommand_t command, LoxCan
   // extension NAT not set?
   if (this->extensionNAT == 0x00)
     return;
-  msg.deviceNAT = driver.isLoxoneLinkBusDriver() ? this->deviceNAT : this->extensionNAT;
-  msg.commandNat = command;
-  msg.extensionNat = this->extensionNAT;
-  send_message(command, msg);
+  prepare_package(command, msg);
+  driver.SendMessage(msg);
 }
 
 /***
@@ -65,7 +75,7 @@ void LoxNATExtension::send_digital_value(uint8_t index, uint32_t value) {
   LoxCanMessage msg;
   msg.value8 = index;
   msg.value32 = value;
-  lox_send_package_if_nat(Digital_Value, msg);
+  send_value_package(Digital_Value, msg);
 }
 
 /***
@@ -77,7 +87,70 @@ void LoxNATExtension::send_analog_value(uint8_t index, uint32_t value, uint16_t
   msg.data[2] = flags >> 8;
   msg.data[1] = format & (flags & 0xF0);
   msg.value32 = value;
-  lox_send_package_if_nat(Analog_Value, msg);
+  send_value_package(Analog_Value, msg);
+}
+
+#if NAT_CRYPT_VALUES_SEND
+/***
+ *  Encrypted command for a plain value command, the command itself if there is none
+ ***/
+static LoxMsgNATCommand_t crypto_command(LoxMsgNATCommand_t command) {
+  switch (command) {
+  case Digital_Value:
+    return CryptoValueDigital;
+  case Analog_Value:
+    return CryptoValueAnalog;
+  case AccessCodeInput:
+    return CryptoValueAccessCodeInput;
+  case Keypad_NfcId:
+    return CryptoNfcId;
+  default:
+    return command;
+  }
+}
+#endif
+
+/***
+ *  Plain command for an encrypted value command, the command itself if there is none
+ ***/
+static LoxMsgNATCommand_t crypto_plain_command(LoxMsgNATCommand_t command) {
+  switch (command) {
+  case CryptoValueDigital:
+    return Digital_Value;
+  case CryptoValueAnalog:
+    return Analog_Value;
+  case CryptoValueAccessCodeInput:
+    return AccessCodeInput;
+  case CryptoNfcId:
+    return Keypad_NfcId;
+  default:
+    return command;
+  }
+}
+
+/***
+ *  Send a value package. Encrypted with the session key, if the Miniserver uses encrypted values
+ *  and NAT_CRYPT_VALUES_SEND is enabled.
+ ***/
+void LoxNATExtension::send_value_package(LoxMsgNATCommand_t command, LoxCanMessage &msg) {
+#if !NAT_CRYPT_VALUES_SEND
+  lox_send_package_if_nat(command, msg);
+#else
+  LoxMsgNATCommand_t cryptoCommand = crypto_command(command);
+  if (!this->cryptValues || cryptoCommand == command) {
+    lox_send_package_if_nat(command, msg);
+    return;
+  }
+  if (this->extensionNAT == 0x00)
+    return;
+  msg.deviceNAT = driver.isLoxoneLinkBusDriver() ? this->deviceNAT : this->extensionNAT;
+  tCryptoValuePacket packet;
+  packet.magic = 0xdeadbeef;
+  memcpy(packet.canData, msg.can_data, sizeof(packet.canData));
+  packet.random = random_range(0, 0xFFFF);
+  CryptoCanAlgo_EncryptDataPacket((uint8_t *)&packet, &this->cryptSessionKey);
+  send_fragmented_message(cryptoCommand, &packet, sizeof(packet));
+#endif
 }
 
 /***
@@ -94,30 +167,24 @@ void LoxNATExtension::send_frequency_value(uint8_t index, uint32_t value) {
  *  Send a fragmented package, which can be longer than 7 bytes.
  ***/
 void LoxNATExtension::send_fragmented_message(LoxMsgNATCommand_t command, const void *data, int size) {
+  // extension NAT not set?
+  if (this->extensionNAT == 0x00)
+    return;
+  this->fragmentSender.Begin(data, size);
   LoxCanMessage msg;
 
   // Send the fragmented header
   msg.value8 = command;
   msg.value16 = size;
   msg.value32 = crc32_stm32_aligned(data, size);
-  msg.deviceNAT = this->deviceNAT;
   msg.fragmented = LoxCmdNATPackage_t_fragmented;
-  lox_send_package_if_nat(Fragment_Start, msg);
+  prepare_package(Fragment_Start, msg);
+  this->fragmentSender.Send(msg);
 
   // send the rest of the data in 7 bytes blocks
-  int packageCount = (size + 6) / 7;
-  int offset = 0;
-  while (packageCount-- > 0) {
-    int packageSize = 7;
-    if (packageCount == 0)
-      packageSize = size - offset;
-#if DEBUG
-    memset(&msg.data, 0, 7); // remove garbage data
-#endif
-    memmove(&msg.data, (uint8_t *)data + offset, packageSize);
-    offset += 7;
-    lox_send_package_if_nat(Fragment_Data, msg);
-  }
+  prepare_package(Fragment_Data, msg);
+  this->fragmentSender.SendData(msg, eFragmentPackage_plain);
+  this->fragmentSender.End();
 }
 
 /***
@@ -232,6 +299,8 @@ void LoxNATExtension::SetState(eDeviceState state) {
   LoxExtension::SetState(state);
   if (state != eDeviceState_offline)
     this->NATStateCounter = 0;
+  else
+    this->cryptValues = false; // a new session starts with plain values
 }
 
 /***
@@ -247,6 +316,8 @@ LoxNATExtension::LoxNATExtension(LoxCANBaseDriver &driver, uint32_t serial, eDev
   this->randomNATIndexRequestDelay = random_range(10, 500);
   this->offlineTimeout = 15 * 60;
   this->offlineCountdownInMs = this->offlineTimeout * 1000;
+  this->cryptValues = false;
+  CryptoCanAlgo_InitPacketKeyLegacy(&this->cryptInitKeyLegacy, this->serial);
   SetState(eDeviceState_offline);
   gLED.identify_off();
 }
@@ -301,6 +372,7 @@ void LoxNATExtension::ReceiveBroadcast(LoxCanMessage &message) {
   case NAT_Offer:
     if (this->serial == message.value32) {
       uint8_t nat = message.data[0]; // NAT Index of the offer
+      this->cryptValues = false;
       if (message.data[1] & 1) {
         this->extensionNAT = nat;
         send_info_package(Start, this->aliveReason ? this->aliveReason : eAliveReason_t_pairing);
@@ -325,6 +397,7 @@ void LoxNATExtension::ReceiveBroadcast(LoxCanMessage &message) {
     break;
   case Park_Devices:
     this->extensionNAT = crc8_default(&this->serial, 4) | 0x80; // mark as a parked device
+    this->cryptValues = false;
     SetState(eDeviceState_parked);
     break;
   case Sync_Packet:
@@ -341,6 +414,41 @@ void LoxNATExtension::ReceiveBroadcast(LoxCanMessage &message) {
   }
 }
 
+/***
+ *  Switch to the session key for a challenge or a rotation of the rolling key. The key is
+ *  solved on demand, its AES key schedule is expanded once and kept with the session key.
+ ***/
+void LoxNATExtension::crypt_session_key(uint32_t random) {
+  this->cryptValues = false; // until a value arrives with the new key
+  CryptoCanAlgo_SolveChallenge(random, this->serial, this->cryptDeviceID, &this->cryptSessionKey);
+}
+
+/***
+ *  An encrypted value command received: decrypt it with the session key and
+ *  handle it like the plain command. The key is expanded once per challenge.
+ *  The runtime of the decryption is measured by the monitor (eMonitorISR_cryptoValue).
+ ***/
+void LoxNATExtension::receive_crypto_value(LoxMsgNATCommand_t command, uint8_t extensionNAT, uint8_t deviceNAT, const uint8_t *data, uint16_t size) {
+  if (size != sizeof(tCryptoValuePacket))
+    return;
+  tCryptoValuePacket packet;
+  memcpy(&packet, data, sizeof(packet));
+  MONITOR_ISR_ENTER();
+  CryptoCanAlgo_DecryptDataPacket((uint8_t *)&packet, &this->cryptSessionKey);
+  MONITOR_ISR_LEAVE(eMonitorISR_cryptoValue);
+  if (packet.magic != 0xdeadbeef) // no or an outdated session key
+    return;
+  this->cryptValues = true;
+  LoxCanMessage msg;
+  msg.busType = this->busType;
+  msg.directionNat = LoxCmdNATDirection_t_fromServer;
+  msg.extensionNat = extensionNAT;
+  msg.commandNat = crypto_plain_command(command);
+  memcpy(msg.can_data, packet.canData, sizeof(msg.can_data));
+  msg.deviceNAT = deviceNAT;
+  ReceiveDirect(msg);
+}
+
 /***
  *  A direct fragmented message received
  ***/
@@ -355,7 +463,7 @@ void LoxNATExtension::ReceiveDirectFragment(LoxMsgNATCommand_t command, uint8_t
   case CryptoDeviceIdRequest: // so far only Tree devices are asked for a DeviceId
     static uint32_t decryptData[4]; // 16 bytes
     memcpy(decryptData, data, sizeof(decryptData));
-    CryptoCanAlgo_DecryptInitPacketLegacy((uint8_t *)decryptData, sizeof(decryptData), this->serial);
+    CryptoCanAlgo_DecryptInitPacketLegacy((uint8_t *)decryptData, sizeof(decryptData), &this->cryptInitKeyLegacy);
     static uint32_t replyData[8]; // 32 bytes
     memset(replyData, 0, sizeof(replyData));
     if(decryptData[0] == 0xdeadbeef) {
@@ -368,31 +476,51 @@ void LoxNATExtension::ReceiveDirectFragment(LoxMsgNATCommand_t command, uint8_t
     // Warning: be aware that two relay extension need two different serial numbers!
     HAL_GetUID((uint32_t *)this->cryptDeviceID);
     memcpy(replyData + 2, this->cryptDeviceID, sizeof(cryptDeviceID));
-    CryptoCanAlgo_EncryptInitPacketLegacy((uint8_t *)replyData, sizeof(replyData), this->serial);
+    CryptoCanAlgo_EncryptInitPacketLegacy((uint8_t *)replyData, sizeof(replyData), &this->cryptInitKeyLegacy);
     send_fragmented_message(CryptoDeviceIdReply, replyData, sizeof(replyData));
     break;
   case CryptoDeviceIdReply: // we should never receive this one
     break;
+  case CryptoValueDigital:
+  case CryptoValueAnalog:
+  case CryptoValueAccessCodeInput:
+  case CryptoNfcId:
+    receive_crypto_value(command, extensionNAT, deviceNAT, data, size);
+    break;
   case CryptoChallengeRequest: // from the Miniserver: check the authorization of an extension
     memcpy(decryptData, data, sizeof(decryptData));
-    CryptoCanAlgo_DecryptInitPacket((uint8_t *)decryptData, this->serial);
+    CryptoCanAlgo_DecryptInitPacket((uint8_t *)decryptData, &this->cryptInitKey);
     if(decryptData[0] == 0xdeadbeef) {
-      CryptoCanAlgo_SolveChallenge(decryptData[1], this->serial, this->cryptDeviceID, this->cryptAesKey, &this->cryptAesIV);
+      crypt_session_key(decryptData[1]);
       memset(decryptData, 0xa5, sizeof(decryptData));
       decryptData[0] = 0xdeadbeef;
       decryptData[1] = random_range(0, 0xFFFF);
-      CryptoCanAlgo_EncryptDataPacket((uint8_t *)decryptData, this->cryptAesKey, this->cryptAesIV);
+      CryptoCanAlgo_EncryptDataPacket((uint8_t *)decryptData, &this->cryptSessionKey);
       send_fragmented_message(CryptoChallengeReply, decryptData, sizeof(decryptData));
     }
     break;
+  case CryptoChallengeRollingKeyRequest: // from the Miniserver: rotate the session key
+    memcpy(decryptData, data, sizeof(decryptData));
+    CryptoCanAlgo_DecryptDataPacket((uint8_t *)decryptData, &this->cryptSessionKey);
+    if(decryptData[0] == 0xdeadbeef) {
+      crypt_session_key(decryptData[1]);
+      memset(decryptData, 0xa5, sizeof(decryptData));
+      decryptData[0] = 0xdeadbeef;
+      decryptData[1] = random_range(0, 0xFFFF);
+      CryptoCanAlgo_EncryptDataPacket((uint8_t *)decryptData, &this->cryptSessionKey);
+      send_fragmented_message(CryptoChallengeRollingKeyReply, decryptData, sizeof(decryptData));
+    }
+    break;
+  case CryptoChallengeRollingKeyReply: // we should never receive this one
+    break;
   case CryptoChallengeReply: // from the Miniserver: validate an existing authorization
     memcpy(decryptData, data, sizeof(decryptData));
-    CryptoCanAlgo_DecryptDataPacket((uint8_t *)decryptData, this->cryptAesKey, this->cryptAesIV);
+    CryptoCanAlgo_DecryptDataPacket((uint8_t *)decryptData, &this->cryptSessionKey);
     if(decryptData[0] == 0xdeadbeef) {
       memset(decryptData, 0xa5, sizeof(decryptData));
       decryptData[0] = 0xdeadbeef;
       decryptData[1] = random_range(0, 0xFFFF);
-      CryptoCanAlgo_EncryptDataPacket((uint8_t *)decryptData, this->cryptAesKey, this->cryptAesIV);
+      CryptoCanAlgo_EncryptDataPacket((uint8_t *)decryptData, &this->cryptSessionKey);
       send_fragmented_message(CryptoChallengeReply, decryptData, sizeof(decryptData));
     }
     break;
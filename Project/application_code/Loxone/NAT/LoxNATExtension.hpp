@@ -12,6 +12,7 @@
 #include "system.hpp"
 
 #define MAX_FRAGMENT_SIZE     64
+#define NAT_CRYPT_VALUES_SEND 0 // 1 = send values encrypted, once the Miniserver sends encrypted values. The layout of tCryptoValuePacket is not confirmed yet.
 
 // Configuration for extensions all share the same header. The configuration is stored in FLASH and
 // validated via a CRC with the Miniserver to be current. If not, the Miniserver automatically uploads
@@ -77,6 +78,15 @@ typedef enum {
   eTreeBranch_rightBranch = 2,
 } eTreeBranch;
 
+// Plain text of the encrypted value commands, one AES block. The data is the CAN data of the
+// matching plain command, e.g. CryptoValueDigital carries a Digital_Value package.
+// This layout is an assumption, it is not yet checked against a Miniserver.
+typedef struct {
+  uint32_t magic;     // 0xdeadbeef, like in the challenge packets
+  uint8_t canData[8]; // deviceNAT, value8, value16, value32
+  uint32_t random;    // varies the cipher text of equal values
+} tCryptoValuePacket;
+
 class LoxNATExtension : public LoxExtension {
 protected:
   // Configuration support
@@ -91,6 +101,8 @@ protected:
   uint32_t fragCRC;
   uint8_t fragBuffer[MAX_FRAGMENT_SIZE];
 
+  tCryptoCanAlgoKey cryptInitKeyLegacy; // for the device ID request of Tree devices
+
   // some internal state variables
   LoxCmdNATBus_t busType;                 // LoxoneLink extension or a Tree device?
   uint8_t extensionNAT;                   // NAT of the extension
@@ -101,10 +113,12 @@ protected:
   int32_t randomNATIndexRequestDelay;
   int32_t offlineTimeout;
   int32_t offlineCountdownInMs;
+  bool cryptValues; // the Miniserver uses encrypted value commands with the current session key
 
   // internal functions
   void send_message(LoxMsgNATCommand_t command, LoxCanMessage &msg);
   void send_special_message(LoxMsgNATCommand_t command);
+  void prepare_package(LoxMsgNATCommand_t command, LoxCanMessage &msg);
   void lox_send_package_if_nat(LoxMsgNATCommand_t command, LoxCanMessage &msg);
   void send_fragmented_message(LoxMsgNATCommand_t command, const void *data, int dataCount);
   void send_alive_package(void);
@@ -113,6 +127,9 @@ protected:
   void send_digital_value(uint8_t index, uint32_t value);
   void send_analog_value(uint8_t index, uint32_t value, uint16_t flags, eAnalogFormat format);
   void send_frequency_value(uint8_t index, uint32_t value);
+  void send_value_package(LoxMsgNATCommand_t command, LoxCanMessage &msg);
+  void crypt_session_key(uint32_t random);
+  void receive_crypto_value(LoxMsgNATCommand_t command, uint8_t extensionNAT, uint8_t deviceNAT, const uint8_t *data, uint16_t size);
   void update(const eUpdatePackage *updatePackage);
   void config_data(const tConfigHeader *config);
   uint32_t config_CRC(void);
@@ -132,6 +149,9 @@ public:
 
   virtual void Timer10ms(void);
   virtual void ReceiveMessage(LoxCanMessage &message);
+
+  // NAT of the extension or Tree device, 0 = none, bit 7 set = parked
+  uint8_t GetNAT(void) const { return this->extensionNAT; };
 };
 
 #endif /* LoxNATExtension_hpp */
\ No newline at end of file
@@ -12,6 +12,8 @@
 
 LoxBusTreeExtension::LoxBusTreeExtension(LoxCANBaseDriver &driver, uint32_t serial, eAliveReason_t alive)
   : LoxNATExtension(driver, (serial & 0xFFFFFF) | (eDeviceType_t_TreeBaseExtension << 24), eDeviceType_t_TreeBaseExtension, 0, 10031125, 0, sizeof(config), &config, alive), treeDevicesLeftCount(0), treeDevicesRightCount(0), leftDriver(this, eTreeBranch_leftBranch), rightDriver(this, eTreeBranch_rightBranch) {
+  memset(this->treeDevicesLeftByNAT, 0, sizeof(this->treeDevicesLeftByNAT));
+  memset(this->treeDevicesRightByNAT, 0, sizeof(this->treeDevicesRightByNAT));
 }
 
 /***
@@ -27,6 +29,36 @@ void LoxBusTreeExtension::AddDevice(LoxBusTreeDevice *device, eTreeBranch branch
   }
 }
 
+/***
+ *  Rebuild the NAT tables, after devices got a new NAT or have been parked.
+ *  Parked devices are not in the table, messages to them are sent to all devices.
+ ***/
+void LoxBusTreeExtension::update_nat_table(void) {
+  memset(this->treeDevicesLeftByNAT, 0, sizeof(this->treeDevicesLeftByNAT));
+  memset(this->treeDevicesRightByNAT, 0, sizeof(this->treeDevicesRightByNAT));
+  for (int i = 0; i < this->treeDevicesLeftCount; ++i) {
+    uint8_t nat = this->treeDevicesLeft[i]->GetNAT();
+    if (nat != 0x00 and (nat & TREE_NAT_PARKED) == 0x00)
+      this->treeDevicesLeftByNAT[nat & TREE_NAT_INDEX_MASK] = this->treeDevicesLeft[i];
+  }
+  for (int i = 0; i < this->treeDevicesRightCount; ++i) {
+    uint8_t nat = this->treeDevicesRight[i]->GetNAT();
+    if (nat != 0x00 and (nat & TREE_NAT_PARKED) == 0x00)
+      this->treeDevicesRightByNAT[nat & TREE_NAT_INDEX_MASK] = this->treeDevicesRight[i];
+  }
+}
+
+/***
+ *  The device with a certain NAT, NULL if there is none
+ ***/
+LoxBusTreeDevice *LoxBusTreeExtension::device_by_nat(uint8_t nat) const {
+  if (nat & TREE_NAT_PARKED)
+    return NULL;
+  if (nat & TREE_NAT_LEFT_BRANCH)
+    return this->treeDevicesLeftByNAT[nat & TREE_NAT_INDEX_MASK];
+  return this->treeDevicesRightByNAT[nat & TREE_NAT_INDEX_MASK];
+}
+
 LoxBusTreeExtensionCANDriver &LoxBusTreeExtension::Driver(eTreeBranch branch) {
   if (branch == eTreeBranch_leftBranch)
     return this->leftDriver;
@@ -60,23 +92,29 @@ void LoxBusTreeExtension::ReceiveDirect(LoxCanMessage &message) {
     message.busType = LoxCmdNATBus_t_TreeBus;
     uint8_t nat = message.deviceNAT;
     message.extensionNat = nat;
+    LoxMsgNATCommand_t command = LoxMsgNATCommand_t(message.commandNat);
     // messages to parked devices is sent to both branches for parked devices, except for a NAT offer
-    if ((nat & 0x80) == 0x80 and message.commandNat != NAT_Offer) {
+    if ((nat & TREE_NAT_PARKED) == TREE_NAT_PARKED and command != NAT_Offer) {
       for (int i = 0; i < this->treeDevicesLeftCount; ++i)
         this->treeDevicesLeft[i]->ReceiveMessage(message);
       for (int i = 0; i < this->treeDevicesRightCount; ++i)
         this->treeDevicesRight[i]->ReceiveMessage(message);
-    } else {
-      if (message.commandNat == NAT_Offer)
-        nat = message.data[0]; // for NAT offset use the new NAT
-      if (nat & 0x40) {        // left branch?
+    } else if (command == NAT_Offer) {  // the device doesn't have the NAT yet, it checks the serial number
+      nat = message.data[0];            // for NAT offset use the new NAT
+      if (nat & TREE_NAT_LEFT_BRANCH) { // left branch?
         for (int i = 0; i < this->treeDevicesLeftCount; ++i)
           this->treeDevicesLeft[i]->ReceiveMessage(message);
       } else { // right branch
         for (int i = 0; i < this->treeDevicesRightCount; ++i)
           this->treeDevicesRight[i]->ReceiveMessage(message);
       }
+    } else {
+      LoxBusTreeDevice *device = device_by_nat(nat);
+      if (device)
+        device->ReceiveMessage(message);
     }
+    if (command == NAT_Offer or command == Park_Devices)
+      update_nat_table();
   } else {
     LoxCanMessage msg;
     switch (message.commandNat) {
@@ -108,19 +146,25 @@ void LoxBusTreeExtension::ReceiveBroadcast(LoxCanMessage &message) {
     this->treeDevicesLeft[i]->ReceiveMessage(message);
   for (int i = 0; i < this->treeDevicesRightCount; ++i)
     this->treeDevicesRight[i]->ReceiveMessage(message);
+  if (message.commandNat == NAT_Offer or message.commandNat == Park_Devices)
+    update_nat_table();
 }
 
 void LoxBusTreeExtension::ReceiveDirectFragment(LoxMsgNATCommand_t command, uint8_t extensionNAT, uint8_t deviceNAT, const uint8_t *data, uint16_t size) {
   if (deviceNAT == 0x00 || driver.isTreeBusDriver()) { // to this device?
     LoxNATExtension::ReceiveDirectFragment(command, extensionNAT, deviceNAT, data, size);
-  } else {
-    if (deviceNAT & 0x40) { // left tree?
+  } else if (deviceNAT & TREE_NAT_PARKED) { // parked devices don't have a unique NAT, send it to the branch
+    if (deviceNAT & TREE_NAT_LEFT_BRANCH) {   // left tree?
       for (int i = 0; i < this->treeDevicesLeftCount; ++i)
         this->treeDevicesLeft[i]->ReceiveDirectFragment(command, deviceNAT, deviceNAT, data, size);
     } else {
       for (int i = 0; i < this->treeDevicesRightCount; ++i)
         this->treeDevicesRight[i]->ReceiveDirectFragment(command, deviceNAT, deviceNAT, data, size);
     }
+  } else {
+    LoxBusTreeDevice *device = device_by_nat(deviceNAT);
+    if (device)
+      device->ReceiveDirectFragment(command, deviceNAT, deviceNAT, data, size);
   }
 }
 
@@ -13,6 +13,9 @@
 #include "LoxBusTreeExtensionCANDriver.hpp"
 
 #define MAX_TREE_DEVICECOUNT 62 // max. number per branch (6 bits, but 0 and 63 are reserved)
+#define TREE_NAT_INDEX_MASK 0x3F // NAT index within a branch
+#define TREE_NAT_LEFT_BRANCH 0x40
+#define TREE_NAT_PARKED 0x80
 
 class tTreeExtensionConfig : public tConfigHeader {
 public:
@@ -29,6 +32,12 @@ private:
   LoxBusTreeExtensionCANDriver rightDriver;
   int treeDevicesRightCount;
   LoxBusTreeDevice *treeDevicesRight[MAX_TREE_DEVICECOUNT];
+  // devices by their NAT index, to forward direct messages without asking every device
+  LoxBusTreeDevice *treeDevicesLeftByNAT[TREE_NAT_INDEX_MASK + 1];
+  LoxBusTreeDevice *treeDevicesRightByNAT[TREE_NAT_INDEX_MASK + 1];
+
+  void update_nat_table(void);
+  LoxBusTreeDevice *device_by_nat(uint8_t nat) const;
 
 public:
   tTreeExtensionConfig config;
@@ -41,6 +50,7 @@ public:
   virtual void Timer10ms(void);
 
   void from_treebus_to_loxonelink(eTreeBranch treeBranch, LoxCanMessage &message);
+  uint32_t GetTransmitQueueCount() { return driver.GetTransmitQueueCount(); };
 
 public:
   LoxBusTreeExtension(LoxCANBaseDriver &driver, uint32_t serial, eAliveReason_t alive);
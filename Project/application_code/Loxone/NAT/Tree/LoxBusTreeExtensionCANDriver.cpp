@@ -27,6 +27,10 @@ uint8_t LoxBusTreeExtensionCANDriver::GetReceiveErrorCounter() const {
   return 0; // never any errors
 }
 
+uint32_t LoxBusTreeExtensionCANDriver::GetTransmitQueueCount() {
+  return this->parentTreeExtension->GetTransmitQueueCount(); // all messages end up in the queue of the Loxone Link driver
+}
+
 /***
  *  Send the message from the device back to the Tree Base Extension
  ***/
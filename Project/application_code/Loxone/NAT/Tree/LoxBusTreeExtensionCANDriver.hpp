@@ -28,6 +28,7 @@ public:
   uint32_t GetErrorCounter() const;
   uint8_t GetTransmitErrorCounter() const;
   uint8_t GetReceiveErrorCounter() const;
+  uint32_t GetTransmitQueueCount();
 
   // send a message onto the CAN bus
   void SendMessage(LoxCanMessage &message);
@@ -23,8 +23,7 @@ void random_init(uint32_t seed) {
   gRandomSeed = seed;
 }
 
-uint8_t crc8_default(const void *data, size_t len) {
-  uint8_t crc = 0x00;
+uint8_t crc8_default(const void *data, size_t len, uint8_t crc) {
   for (int i = 0; i < len; i++) {
     crc ^= ((uint8_t *)data)[i];
     for (int j = 0; j < 8; j++) {
@@ -52,8 +51,7 @@ uint8_t crc8_OneWire(const uint8_t *data, size_t size) {
   return crc;
 }
 
-uint16_t crc16_Modus(const void *data, size_t size) {
-  uint16_t crc = 0xFFFF;
+uint16_t crc16_Modus(const void *data, size_t size, uint16_t crc) {
   for (int i = 0; i < size; i++) {
     crc ^= ((uint8_t *)data)[i];
     for (int j = 0; j < 8; j++) {
@@ -19,14 +19,14 @@ void random_init(uint32_t seed);
 
 // These are the 3 commonly used CRC algorithms for the Loxone hardware:
 
-// simple CRC8 with a Polynome of 0x85
-uint8_t crc8_default(const void *data, size_t len);
+// simple CRC8 with a Polynome of 0x85. Pass the previous result as crc to continue over several buffers.
+uint8_t crc8_default(const void *data, size_t len, uint8_t crc = 0x00);
 
 // Used for Maxim 1-Wire hardware to calculate the CRC over the serialnumber
 uint8_t crc8_OneWire(const void *data, size_t size);
 
-// Used for Modbus, a CRC16
-uint16_t crc16_Modus(const void *data, size_t size);
+// Used for Modbus, a CRC16. Pass the previous result as crc to continue over several buffers.
+uint16_t crc16_Modus(const void *data, size_t size, uint16_t crc = 0xFFFF);
 
 // STM32 CRC32 algorithm as available in the STM32 hardware. Used as CRC32 over packages, etc
 uint32_t crc32_stm32_aligned(const void *data, size_t size);
@@ -0,0 +1,203 @@
+//
+//  Monitor.cpp
+//
+//  Part of LoxLink.
+//
+
+#include "Monitor.hpp"
+#include <__cross_studio_io.h>
+#include <string.h>
+
+typedef struct {
+  CTL_TASK_t *task;
+  const char *name;
+  unsigned *stack; // first word of the stack (the word after the lower guard)
+  unsigned stackSize;
+  uint64_t cycles; // CPU cycles spend in this task since the last reset
+} sMonitorTask;
+
+static sMonitorTask sTasks[MONITOR_MAX_TASKS];
+static int sTaskCount;
+static uint64_t sOtherCycles; // cycles of tasks, which are not registered
+static uint32_t sLastSwitchCycles;
+
+static struct {
+  uint64_t cycles;
+  uint32_t count;
+  uint32_t maxCycles;
+} sISR[eMonitorISR_count];
+
+/***
+ *  Find the statistics entry for a task
+ ***/
+static sMonitorTask *monitor_find(CTL_TASK_t *task) {
+  for (int i = 0; i < sTaskCount; ++i) {
+    if (sTasks[i].task == task)
+      return &sTasks[i];
+  }
+  return NULL;
+}
+
+/***
+ *  Add the cycles since the last context switch to the currently executing task.
+ *  Has to be called with interrupts disabled.
+ ***/
+static void monitor_account_executing(void) {
+  uint32_t now = DWT->CYCCNT;
+  uint32_t cycles = now - sLastSwitchCycles;
+  sLastSwitchCycles = now;
+  sMonitorTask *t = monitor_find(ctl_task_executing);
+  if (t)
+    t->cycles += cycles;
+  else
+    sOtherCycles += cycles;
+}
+
+/***
+ *  Called by CTL before switching to another task. ctl_task_executing is still the old task.
+ ***/
+static void monitor_task_switch(CTL_TASK_t *next) {
+  monitor_account_executing();
+}
+
+/***
+ *  Enable the DWT cycle counter and hook into the CTL task switch
+ ***/
+void monitor_init(void) {
+  CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+  DWT->CYCCNT = 0;
+  DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+  sLastSwitchCycles = DWT->CYCCNT;
+  ctl_task_switch_callout = monitor_task_switch;
+}
+
+/***
+ *  Register a task for the statistics. The stack points to an array of 1+stackSize+1 words,
+ *  with guard words at the beginning and the end. If stack is NULL, the stack is not checked.
+ ***/
+void monitor_task_register(CTL_TASK_t *task, const char *name, unsigned stackSize, unsigned *stack) {
+  int en = ctl_global_interrupts_disable();
+  if (sTaskCount < MONITOR_MAX_TASKS) {
+    sMonitorTask *t = &sTasks[sTaskCount++];
+    t->task = task;
+    t->name = name;
+    t->stack = stack ? stack + 1 : NULL;
+    t->stackSize = stack ? stackSize : 0;
+    t->cycles = 0;
+  }
+  ctl_global_interrupts_set(en);
+}
+
+/***
+ *  Paint the stack, set the guard words and start the task. Used instead of ctl_task_run().
+ *  The stack has to be an array of 1+stackSize+1 words.
+ ***/
+void monitor_task_run(CTL_TASK_t *task, unsigned char priority, void (*entrypoint)(void *), void *parameter, const char *name, unsigned stackSize, unsigned *stack) {
+  stack[0] = stack[1 + stackSize] = MONITOR_STACK_MARKER; // put marker values at the words before/after the stack
+  for (unsigned i = 1; i <= stackSize; ++i)
+    stack[i] = MONITOR_STACK_PAINT;
+  monitor_task_register(task, name, stackSize, stack);
+  ctl_task_run(task, priority, entrypoint, parameter, name, stackSize, stack + 1, 0);
+}
+
+/***
+ *  Account the runtime of one interrupt. Interrupts of the same source never nest,
+ *  so the entry can be updated without locking.
+ ***/
+void monitor_isr_account(eMonitorISR isr, uint32_t cycles) {
+  sISR[isr].cycles += cycles;
+  sISR[isr].count++;
+  if (cycles > sISR[isr].maxCycles)
+    sISR[isr].maxCycles = cycles;
+}
+
+/***
+ *  Total number of cycles since the last reset. The task cycles cover all CPU time,
+ *  interrupt time is included in the task it interrupted.
+ ***/
+static uint64_t monitor_total_cycles(void) {
+  uint64_t total = sOtherCycles;
+  for (int i = 0; i < sTaskCount; ++i)
+    total += sTasks[i].cycles;
+  return total;
+}
+
+static uint16_t monitor_permille(uint64_t cycles, uint64_t total) {
+  if (total == 0)
+    return 0;
+  return cycles * 1000 / total;
+}
+
+int monitor_task_count(void) {
+  return sTaskCount;
+}
+
+/***
+ *  CPU load and stack usage of a registered task
+ ***/
+void monitor_task_info(int index, tMonitorTaskInfo *info) {
+  memset(info, 0, sizeof(*info));
+  if (index < 0 || index >= sTaskCount)
+    return;
+  const sMonitorTask *t = &sTasks[index];
+  int en = ctl_global_interrupts_disable();
+  monitor_account_executing();
+  uint64_t cycles = t->cycles;
+  uint64_t total = monitor_total_cycles();
+  ctl_global_interrupts_set(en);
+
+  info->name = t->name;
+  info->loadPermille = monitor_permille(cycles, total);
+  if (t->stack) {
+    // the stack grows downwards, so count the untouched words from the bottom
+    unsigned unused = 0;
+    while (unused < t->stackSize && t->stack[unused] == MONITOR_STACK_PAINT)
+      ++unused;
+    info->stackSize = t->stackSize;
+    info->stackUsed = t->stackSize - unused;
+    info->stackOverflow = t->stack[-1] != MONITOR_STACK_MARKER || t->stack[t->stackSize] != MONITOR_STACK_MARKER;
+  }
+}
+
+/***
+ *  CPU load and runtime of an interrupt source
+ ***/
+void monitor_isr_info(eMonitorISR isr, tMonitorISRInfo *info) {
+  int en = ctl_global_interrupts_disable();
+  monitor_account_executing();
+  uint64_t cycles = sISR[isr].cycles;
+  uint64_t total = monitor_total_cycles();
+  info->count = sISR[isr].count;
+  info->maxCycles = sISR[isr].maxCycles;
+  ctl_global_interrupts_set(en);
+  info->loadPermille = monitor_permille(cycles, total);
+}
+
+/***
+ *  Start a new measurement window. The stack high-water marks are not reset.
+ ***/
+void monitor_reset(void) {
+  int en = ctl_global_interrupts_disable();
+  sLastSwitchCycles = DWT->CYCCNT;
+  sOtherCycles = 0;
+  for (int i = 0; i < sTaskCount; ++i)
+    sTasks[i].cycles = 0;
+  memset(sISR, 0, sizeof(sISR));
+  ctl_global_interrupts_set(en);
+}
+
+#if DEBUG
+void monitor_print(void) {
+  static const char *isrNames[eMonitorISR_count] = {"CAN", "TIM3", "EXTI", "USART1", "USART2", "USART3", "ADC", "CRYPT"};
+  for (int i = 0; i < sTaskCount; ++i) {
+    tMonitorTaskInfo info;
+    monitor_task_info(i, &info);
+    debug_printf("%-8s CPU:%3d.%d%% Stack:%d/%d%s\n", info.name, info.loadPermille / 10, info.loadPermille % 10, info.stackUsed, info.stackSize, info.stackOverflow ? " OVERFLOW" : "");
+  }
+  for (int i = 0; i < eMonitorISR_count; ++i) {
+    tMonitorISRInfo info;
+    monitor_isr_info(eMonitorISR(i), &info);
+    debug_printf("%-8s CPU:%3d.%d%% IRQs:%d max:%d cycles\n", isrNames[i], info.loadPermille / 10, info.loadPermille % 10, info.count, info.maxCycles);
+  }
+}
+#endif
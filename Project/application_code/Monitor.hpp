@@ -0,0 +1,72 @@
+//
+//  Monitor.hpp
+//
+//  Part of LoxLink.
+//
+
+#ifndef MONITOR_H
+#define MONITOR_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "stm32f1xx.h"
+#include <ctl_api.h>
+#include <stdint.h>
+
+#define MONITOR_MAX_TASKS 12
+#define MONITOR_STACK_MARKER 0xfacefeed // guard words before/after each task stack
+#define MONITOR_STACK_PAINT 0xcdcdcdcd  // pattern filled into unused stack space
+
+// interrupt sources and code sections, which are measured by the runtime monitor
+typedef enum {
+  eMonitorISR_CAN,
+  eMonitorISR_TIM3,
+  eMonitorISR_EXTI,
+  eMonitorISR_USART1,
+  eMonitorISR_USART2,
+  eMonitorISR_USART3,
+  eMonitorISR_ADC,
+  eMonitorISR_cryptoValue, // not an interrupt: decryption of an encrypted value command in the CAN RX task
+  eMonitorISR_count
+} eMonitorISR;
+
+typedef struct {
+  const char *name;
+  uint16_t loadPermille; // CPU load in 0.1% since the last statistics reset
+  uint16_t stackSize;    // stack size in words, 0 = unknown (main task)
+  uint16_t stackUsed;    // high-water mark in words
+  uint8_t stackOverflow; // one of the guard words was overwritten
+} tMonitorTaskInfo;
+
+typedef struct {
+  uint16_t loadPermille; // CPU load in 0.1% since the last statistics reset
+  uint32_t count;        // number of interrupts since the last statistics reset
+  uint32_t maxCycles;    // longest runtime of a single interrupt in CPU cycles
+} tMonitorISRInfo;
+
+void monitor_init(void);
+void monitor_task_register(CTL_TASK_t *task, const char *name, unsigned stackSize, unsigned *stack);
+void monitor_task_run(CTL_TASK_t *task, unsigned char priority, void (*entrypoint)(void *), void *parameter, const char *name, unsigned stackSize, unsigned *stack);
+
+int monitor_task_count(void);
+void monitor_task_info(int index, tMonitorTaskInfo *info);
+void monitor_isr_info(eMonitorISR isr, tMonitorISRInfo *info);
+void monitor_reset(void);
+#if DEBUG
+void monitor_print(void);
+#endif
+
+// used by the MONITOR_ISR_ macros
+void monitor_isr_account(eMonitorISR isr, uint32_t cycles);
+
+// Bracket an interrupt handler or a code section with these two macros to measure its runtime
+#define MONITOR_ISR_ENTER() const uint32_t monitorISRStart = DWT->CYCCNT
+#define MONITOR_ISR_LEAVE(isr) monitor_isr_account(isr, DWT->CYCCNT - monitorISRStart)
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
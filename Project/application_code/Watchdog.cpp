@@ -1,5 +1,6 @@
 #include "Watchdog.hpp"
 #include "stm32f1xx_hal_iwdg.h"
+#include "Monitor.hpp"
 #include <ctl_api.h>
 
 IWDG_HandleTypeDef gIWDG;
@@ -34,9 +35,8 @@ void Start_Watchdog(void) {
   // Run this task at almost the lowest priority (1)
   #define STACKSIZE 64          
   static unsigned stack[1+STACKSIZE+1];
-  stack[0]=stack[1+STACKSIZE]=0xfacefeed; // put marker values at the words before/after the stack
   static CTL_TASK_t watchdog;
-  ctl_task_run(&watchdog, 1, vWatchdogTask, 0, "Watchdog", STACKSIZE, stack+1, 0);
+  monitor_task_run(&watchdog, 1, vWatchdogTask, 0, "Watchdog", STACKSIZE, stack);
   
   __HAL_IWDG_START(&gIWDG);
 }
\ No newline at end of file
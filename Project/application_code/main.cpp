@@ -1,6 +1,7 @@
 #include "system.hpp"
 
 #include "LED.hpp"
+#include "Monitor.hpp"
 #include "Watchdog.hpp"
 
 #include "LoxCANDriver_STM32.hpp"
@@ -9,9 +10,9 @@
 //#include "LoxBusTreeAlarmSiren.hpp"
 //#include "LoxBusTreeRoomComfortSensor.hpp"
 //#include "LoxBusTreeTouch.hpp"
-//#include "LoxLegacyDMXExtension.hpp"
-//#include "LoxLegacyRS232Extension.hpp"
-//#include "LoxLegacyModbusExtension.hpp"
+#include "LoxLegacyDMXExtension.hpp"
+#include "LoxLegacyRS232Extension.hpp"
+#include "LoxLegacyModbusExtension.hpp"
 #include "LoxLegacyRelayExtension.hpp"
 //#include "LoxBusTreeRgbwDimmer.hpp"
 
@@ -20,20 +21,24 @@ int main(void) {
 
   static CTL_TASK_t main_task;
   ctl_task_init(&main_task, 255, "main"); // create subsequent tasks whilst running at the highest priority.
+  monitor_init();
+  monitor_task_register(&main_task, "main", 0, NULL); // the main task is the idle loop
 
   // Warning: be aware that two relay extension need two different serial numbers!
   uint32_t serial_base = serialnumber_24bit();
 
   static LoxCANDriver_STM32 gLoxCANDriver(tLoxCANDriverType_LoxoneLink);
 #if EXTENSION_RS232
-//  static LoxLegacyRS232Extension gLoxLegacyRS232Extension(gLoxCANDriver, serial_base);
+  static LoxLegacyRS232Extension gLoxLegacyRS232Extension(gLoxCANDriver, serial_base);
 #endif
 #if EXTENSION_MODBUS
-//  static LoxLegacyModbusExtension gLoxLegacyModbusExtension(gLoxCANDriver, serial_base);
+  static LoxLegacyModbusExtension gLoxLegacyModbusExtension(gLoxCANDriver, serial_base);
 #endif
   static LoxBusDIExtension gDIExtension(gLoxCANDriver, serial_base, gResetReason);
   static LoxLegacyRelayExtension gRelayExtension(gLoxCANDriver, serial_base);
-  //static LoxLegacyDMXExtension gDMXExtension(gLoxCANDriver, serial_base);
+#if EXTENSION_DMX
+  static LoxLegacyDMXExtension gDMXExtension(gLoxCANDriver, serial_base);
+#endif
   //static LoxBusTreeExtension gTreeExtension(gLoxCANDriver, serial_base, gResetReason);
   //  static LoxBusTreeRoomComfortSensor gTreeRoomComfortSensor(gTreeExtension.Driver(eTreeBranch_rightBranch), 0xb0112233, gResetReason);
   //  gTreeExtension.AddDevice(&gTreeRoomComfortSensor, eTreeBranch_rightBranch);
@@ -1,4 +1,5 @@
 #include "system.hpp"
+#include "Monitor.hpp"
 #include "stm32f1xx_hal.h" // HAL_IncTick
 #include "stm32f1xx_hal_conf.h"
 #include "stm32f1xx_hal_pwr.h"
@@ -81,6 +82,7 @@ void system_init(void) {
   HAL_Init();
   SystemClock_Config();
   gResetReason = MX_reset_reason();
+  MX_temperature_init();
 
   ctl_start_timer(Timer_Callback_1000Hz); // start the timer
   ctl_set_priority(SysTick_IRQn, 2u);
@@ -265,48 +267,112 @@ extern "C" void HAL_ADC_MspDeInit(ADC_HandleTypeDef *hadc) {
   }
 }
 
-/**
-  * @brief ADC1 Initialization Function
-  * @param None
-  * @retval None
-  */
-float MX_read_temperature(void) {
-  static ADC_HandleTypeDef sADC1;
+// Background sampling of the temperature sensor: TIM2 triggers an ADC conversion every millisecond,
+// the DMA writes them into a circular buffer and each buffer half is averaged and filtered.
+#define TEMPERATURE_SAMPLE_RATE_HZ 1000
+#define TEMPERATURE_DMA_SAMPLES 32 // two halves of 16 samples
+#define TEMPERATURE_IIR_SHIFT 4    // IIR filter with a time constant of 16 blocks (256ms)
 
-  /** Common config */
-  sADC1.Instance = ADC1;
-  sADC1.Init.ScanConvMode = ADC_SCAN_DISABLE;
-  sADC1.Init.ContinuousConvMode = DISABLE;
-  sADC1.Init.DiscontinuousConvMode = DISABLE;
-  sADC1.Init.ExternalTrigConv = ADC_SOFTWARE_START;
-  sADC1.Init.DataAlign = ADC_DATAALIGN_RIGHT;
-  sADC1.Init.NbrOfConversion = 1;
-  if (HAL_ADC_Init(&sADC1) != HAL_OK) {
-    /* Loop forever */
-    for (;;)
-      ;
-  }
-  /** Configure Regular Channel */
-  ADC_ChannelConfTypeDef sConfig = {0};
-  sConfig.Channel = ADC_CHANNEL_TEMPSENSOR;
-  sConfig.Rank = ADC_REGULAR_RANK_1;
-  sConfig.SamplingTime = ADC_SAMPLETIME_239CYCLES_5;
-  if (HAL_ADC_ConfigChannel(&sADC1, &sConfig) != HAL_OK) {
-    /* Loop forever */
-    for (;;)
-      ;
-  }
+static uint16_t gTemperatureSamples[TEMPERATURE_DMA_SAMPLES];
+static uint32_t gTemperatureFilter;         // filtered ADC value << 8
+static volatile int32_t gTemperatureX10;    // cached temperature in 0.1 Celsius
+
+/***
+ *  Convert the filtered ADC value (ADC value << 8) into 0.1 Celsius
+ *  T = (V25 - V) / AVG_SLOPE + 25 with V25 = 1.43V, AVG_SLOPE = 4.3mV/C, 3.3V reference
+ ***/
+static int32_t temperature_from_adc(uint32_t filter) {
+  int32_t voltage = ((filter >> 4) * 33000u) >> 16; // in 0.1mV
+  return (14300 - voltage) * 10 / 43 + 250;
+}
+
+/***
+ *  Add the sum of 16 oversampled values to the IIR filter
+ ***/
+static void temperature_add_block(const uint16_t *samples) {
+  uint32_t sum = 0;
+  for (int i = 0; i < TEMPERATURE_DMA_SAMPLES / 2; ++i)
+    sum += samples[i];
+  uint32_t value = sum << 4; // 16 samples => ADC value << 8
+  gTemperatureFilter += (int32_t(value - gTemperatureFilter)) >> TEMPERATURE_IIR_SHIFT;
+  gTemperatureX10 = temperature_from_adc(gTemperatureFilter);
+}
+
+extern "C" void DMA1_Channel1_IRQHandler(void) {
+  MONITOR_ISR_ENTER();
+  uint32_t isr = DMA1->ISR;
+  DMA1->IFCR = DMA_IFCR_CGIF1;
+  if (isr & DMA_ISR_HTIF1)
+    temperature_add_block(&gTemperatureSamples[0]);
+  if (isr & DMA_ISR_TCIF1)
+    temperature_add_block(&gTemperatureSamples[TEMPERATURE_DMA_SAMPLES / 2]);
+  MONITOR_ISR_LEAVE(eMonitorISR_ADC);
+}
+
+/***
+ *  Setup the continuous sampling of the internal temperature sensor
+ ***/
+void MX_temperature_init(void) {
+  __HAL_RCC_ADC1_CLK_ENABLE();
+  __HAL_RCC_TIM2_CLK_ENABLE();
+  __HAL_RCC_DMA1_CLK_ENABLE();
+  MODIFY_REG(RCC->CFGR, RCC_CFGR_ADCPRE, RCC_CFGR_ADCPRE_DIV6); // 12MHz ADC clock (max. 14MHz)
 
-  while (HAL_ADCEx_Calibration_Start(&sADC1) != HAL_OK)
+  // one conversion of the temperature sensor with the longest sample time (17.1us are required)
+  ADC1->CR1 = 0;
+  ADC1->CR2 = ADC_CR2_TSVREFE | ADC_CR2_EXTSEL | ADC_CR2_EXTTRIG; // software start for now
+  ADC1->SMPR1 = ADC_SMPR1_SMP16; // 239.5 cycles
+  ADC1->SQR1 = 0;                // 1 conversion
+  ADC1->SQR3 = ADC_CHANNEL_TEMPSENSOR;
+  ADC1->CR2 |= ADC_CR2_ADON; // power up
+  for (volatile int i = 0; i < 100; ++i) // wait tSTAB (1us) before the calibration
+    ;
+  ADC1->CR2 |= ADC_CR2_RSTCAL;
+  while (ADC1->CR2 & ADC_CR2_RSTCAL)
     ;
-  HAL_ADC_Start(&sADC1);
-  while (HAL_ADC_PollForConversion(&sADC1, 0) != HAL_OK)
+  ADC1->CR2 |= ADC_CR2_CAL;
+  while (ADC1->CR2 & ADC_CR2_CAL)
+    ;
+
+  // a first conversion to initialize the filter, so the temperature is valid right away
+  ADC1->CR2 |= ADC_CR2_SWSTART;
+  while (!(ADC1->SR & ADC_SR_EOC))
     ;
-  uint16_t adcValue = HAL_ADC_GetValue(&sADC1);
-  const float AVG_SLOPE = 4.3E-03;
-  const float V25 = 1.43;
-  const float ADC_TO_VOLT = 3.3 / 4096;
-  float temp = (V25 - adcValue * ADC_TO_VOLT) / AVG_SLOPE + 25.0f;
-  HAL_ADC_Stop(&sADC1);
-  return temp;
-}
\ No newline at end of file
+  gTemperatureFilter = (ADC1->DR & 0xFFF) << 8;
+  gTemperatureX10 = temperature_from_adc(gTemperatureFilter);
+
+  // DMA1 channel 1: ADC1 => circular buffer, interrupt at half and full transfer
+  DMA1_Channel1->CCR = 0;
+  DMA1_Channel1->CPAR = uint32_t(&ADC1->DR);
+  DMA1_Channel1->CMAR = uint32_t(gTemperatureSamples);
+  DMA1_Channel1->CNDTR = TEMPERATURE_DMA_SAMPLES;
+  DMA1_Channel1->CCR = DMA_CCR_PL_0 | DMA_CCR_MSIZE_0 | DMA_CCR_PSIZE_0 | DMA_CCR_MINC | DMA_CCR_CIRC | DMA_CCR_HTIE | DMA_CCR_TCIE | DMA_CCR_EN;
+  HAL_NVIC_SetPriority(DMA1_Channel1_IRQn, 6, 0);
+  HAL_NVIC_EnableIRQ(DMA1_Channel1_IRQn);
+
+  // TIM2 CC2 triggers the conversions
+  ADC1->CR2 = ADC_CR2_TSVREFE | ADC_CR2_EXTSEL_1 | ADC_CR2_EXTSEL_0 | ADC_CR2_EXTTRIG | ADC_CR2_DMA | ADC_CR2_ADON;
+  const uint32_t timerClock = 2 * HAL_RCC_GetPCLK1Freq(); // APB1 prescaler != 1 => timer clock is doubled
+  TIM2->CR1 = 0;
+  TIM2->PSC = timerClock / 1000000 - 1; // 1MHz
+  TIM2->ARR = 1000000 / TEMPERATURE_SAMPLE_RATE_HZ - 1;
+  TIM2->CCR2 = TIM2->ARR / 2;
+  TIM2->CCMR1 = TIM_CCMR1_OC2M_2 | TIM_CCMR1_OC2M_1; // PWM mode 1, generates a rising edge on CC2 every period
+  TIM2->CCER = TIM_CCER_CC2E;
+  TIM2->EGR = TIM_EGR_UG;
+  TIM2->CR1 = TIM_CR1_CEN;
+}
+
+/***
+ *  Current temperature of the CPU in 0.1 Celsius. Does not block, the value is updated in the background.
+ ***/
+int32_t MX_temperature_x10(void) {
+  return gTemperatureX10;
+}
+
+/***
+ *  Current temperature of the CPU in Celsius
+ ***/
+float MX_read_temperature(void) {
+  return MX_temperature_x10() / 10.0f;
+}
@@ -12,6 +12,7 @@ extern "C" {
 typedef enum {
   eMainEvents_10ms = 0x01,
   eMainEvents_CanMessaged = 0x04,
+  eMainEvents_CanSent = 0x08, // a message left the CAN transmit queue
 } eMainEvents;
 
 extern CTL_EVENT_SET_t gMainEvent;
@@ -46,6 +47,8 @@ uint32_t serialnumber_24bit(void);
 #if DEBUG
 void MX_print_cpu_info(void);
 #endif
+void MX_temperature_init(void);
+int32_t MX_temperature_x10(void);
 float MX_read_temperature(void);
 void SystemClock_Config(void);
 
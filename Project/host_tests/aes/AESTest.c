@@ -0,0 +1,118 @@
+//
+//  AESTest.c
+//
+//  Part of LoxLink.
+//
+//  Host test for aes.c of the firmware: the NIST SP 800-38A CBC-AES128 vector and
+//  random CBC round-trips, which have to match the reference implementation byte by byte.
+//  Build and run with "make test", which checks both settings of AES_TTABLE.
+//
+
+#include "aes.h"
+#include "aes_reference.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ROUNDTRIPS 20000
+#define MAX_BLOCKS 4
+
+static int failures = 0;
+
+static void check(int ok, const char *what)
+{
+    if(!ok) {
+        printf("FAIL: %s\n", what);
+        ++failures;
+    }
+}
+
+// NIST SP 800-38A F.2.1 / F.2.2 CBC-AES128
+static void test_vector(void)
+{
+    static const uint8_t key[16] = { 0x2b,0x7e,0x15,0x16,0x28,0xae,0xd2,0xa6,0xab,0xf7,0x15,0x88,0x09,0xcf,0x4f,0x3c };
+    static const uint8_t iv[16] = { 0x00,0x01,0x02,0x03,0x04,0x05,0x06,0x07,0x08,0x09,0x0a,0x0b,0x0c,0x0d,0x0e,0x0f };
+    static const uint8_t plain[64] = {
+        0x6b,0xc1,0xbe,0xe2,0x2e,0x40,0x9f,0x96,0xe9,0x3d,0x7e,0x11,0x73,0x93,0x17,0x2a,
+        0xae,0x2d,0x8a,0x57,0x1e,0x03,0xac,0x9c,0x9e,0xb7,0x6f,0xac,0x45,0xaf,0x8e,0x51,
+        0x30,0xc8,0x1c,0x46,0xa3,0x5c,0xe4,0x11,0xe5,0xfb,0xc1,0x19,0x1a,0x0a,0x52,0xef,
+        0xf6,0x9f,0x24,0x45,0xdf,0x4f,0x9b,0x17,0xad,0x2b,0x41,0x7b,0xe6,0x6c,0x37,0x10 };
+    static const uint8_t cipher[64] = {
+        0x76,0x49,0xab,0xac,0x81,0x19,0xb2,0x46,0xce,0xe9,0x8e,0x9b,0x12,0xe9,0x19,0x7d,
+        0x50,0x86,0xcb,0x9b,0x50,0x72,0x19,0xee,0x95,0xdb,0x11,0x3a,0x91,0x76,0x78,0xb2,
+        0x73,0xbe,0xd6,0xb8,0xe3,0xc1,0x74,0x3b,0x71,0x16,0xe6,0x9e,0x22,0x22,0x95,0x16,
+        0x3f,0xf1,0xca,0xa1,0x68,0x1f,0xac,0x09,0x12,0x0e,0xca,0x30,0x75,0x86,0xe1,0xa7 };
+    struct AES_ctx ctx;
+    uint8_t buf[64];
+
+    memcpy(buf, plain, sizeof(buf));
+    AES_init_ctx_iv(&ctx, key, iv);
+    AES_CBC_encrypt_buffer(&ctx, buf, sizeof(buf));
+    check(memcmp(buf, cipher, sizeof(buf)) == 0, "SP 800-38A encrypt");
+
+    AES_ctx_set_iv(&ctx, iv);
+    AES_CBC_decrypt_buffer(&ctx, buf, sizeof(buf));
+    check(memcmp(buf, plain, sizeof(buf)) == 0, "SP 800-38A decrypt");
+
+    // one block at a time, the IV in the context chains the blocks
+    AES_init_ctx_iv(&ctx, key, iv);
+    for(int i=0; i<4; ++i) {
+        memcpy(buf, plain + i * 16, 16);
+        AES_CBC_encrypt_buffer(&ctx, buf, 16);
+        check(memcmp(buf, cipher + i * 16, 16) == 0, "SP 800-38A encrypt, chained blocks");
+    }
+}
+
+static void random_bytes(uint8_t *buf, int size)
+{
+    for(int i=0; i<size; ++i)
+        buf[i] = rand();
+}
+
+// random keys, IVs and data: the current and the reference implementation have to agree
+static void test_roundtrips(void)
+{
+    for(int n=0; n<ROUNDTRIPS; ++n) {
+        uint8_t key[16], iv[16];
+        uint8_t plain[MAX_BLOCKS * 16], buf[MAX_BLOCKS * 16], ref[MAX_BLOCKS * 16];
+        uint32_t size = (1 + n % MAX_BLOCKS) * 16;
+        struct AES_ctx ctx;
+        struct ref_AES_ctx refCtx;
+
+        random_bytes(key, sizeof(key));
+        random_bytes(iv, sizeof(iv));
+        random_bytes(plain, size);
+        memcpy(buf, plain, size);
+        memcpy(ref, plain, size);
+
+        AES_init_ctx_iv(&ctx, key, iv);
+        ref_AES_init_ctx_iv(&refCtx, key, iv);
+        AES_CBC_encrypt_buffer(&ctx, buf, size);
+        ref_AES_CBC_encrypt_buffer(&refCtx, ref, size);
+        check(memcmp(buf, ref, size) == 0, "encrypt differs from the reference");
+        check(memcmp(ctx.Iv, refCtx.Iv, 16) == 0, "IV after encrypt differs from the reference");
+
+        AES_ctx_set_iv(&ctx, iv);
+        AES_CBC_decrypt_buffer(&ctx, buf, size);
+        check(memcmp(buf, plain, size) == 0, "decrypt doesn't return the plain text");
+
+        random_bytes(ref, size); // decrypt random data, not only valid cipher text
+        memcpy(buf, ref, size);
+        AES_ctx_set_iv(&ctx, iv);
+        ref_AES_ctx_set_iv(&refCtx, iv);
+        AES_CBC_decrypt_buffer(&ctx, buf, size);
+        ref_AES_CBC_decrypt_buffer(&refCtx, ref, size);
+        check(memcmp(buf, ref, size) == 0, "decrypt differs from the reference");
+        if(failures)
+            break;
+    }
+}
+
+int main(void)
+{
+    srand(1);
+    test_vector();
+    test_roundtrips();
+    printf("AES_TTABLE=%d: %d failures\n", AES_TTABLE, failures);
+    return failures ? 1 : 0;
+}
@@ -0,0 +1,17 @@
+//
+//  aes_reference.c
+//
+//  Part of LoxLink.
+//
+//  The unmodified aes.c of the firmware before the T-table rounds were added (reference/),
+//  compiled with renamed symbols, so it can be linked next to the current aes.c.
+//
+
+#define AES_ctx ref_AES_ctx
+#define AES_init_ctx ref_AES_init_ctx
+#define AES_init_ctx_iv ref_AES_init_ctx_iv
+#define AES_ctx_set_iv ref_AES_ctx_set_iv
+#define AES_CBC_encrypt_buffer ref_AES_CBC_encrypt_buffer
+#define AES_CBC_decrypt_buffer ref_AES_CBC_decrypt_buffer
+
+#include "reference/aes.c"
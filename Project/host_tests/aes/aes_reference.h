@@ -0,0 +1,26 @@
+//
+//  aes_reference.h
+//
+//  Part of LoxLink.
+//
+//  API of aes_reference.c, the context matches reference/aes.h (AES128, CBC)
+//
+
+#ifndef aes_reference_h
+#define aes_reference_h
+
+#include <stdint.h>
+
+struct ref_AES_ctx
+{
+    uint8_t RoundKey[176];
+    uint8_t Iv[16];
+};
+
+void ref_AES_init_ctx(struct ref_AES_ctx* ctx, const uint8_t* key);
+void ref_AES_init_ctx_iv(struct ref_AES_ctx* ctx, const uint8_t* key, const uint8_t* iv);
+void ref_AES_ctx_set_iv(struct ref_AES_ctx* ctx, const uint8_t* iv);
+void ref_AES_CBC_encrypt_buffer(struct ref_AES_ctx* ctx, uint8_t* buf, uint32_t length);
+void ref_AES_CBC_decrypt_buffer(struct ref_AES_ctx* ctx, uint8_t* buf, uint32_t length);
+
+#endif /* aes_reference_h */
@@ -0,0 +1,262 @@
+//
+//  RDMSimulator.cpp
+//
+//  Part of LoxLink.
+//
+//  Host test for the RDM discovery of LoxRDMController. The DMX line is replaced by
+//  a list of simulated responders, several replies to DISC_UNIQUE_BRANCH are combined
+//  like on the wire (wired-AND), so they collide. Build and run with "make test".
+//
+
+#include "LoxRDMController.hpp"
+#include <set>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+typedef struct {
+  uint64_t uid;
+  bool muted;
+  bool mutable_; // false = never acknowledges DISC_MUTE, but keeps answering the discovery
+  uint16_t startAddress;
+} sResponder;
+
+static uint64_t get_uid(const uint8_t *p) {
+  uint64_t uid = 0;
+  for (int i = 0; i < 6; ++i)
+    uid = (uid << 8) | p[i];
+  return uid;
+}
+
+class RDMSimulator : public LoxRDMController {
+  // reply of a responder: break, header, parameter data, checksum
+  int reply_packet(const uint8_t *request, const uint8_t *data, int dataSize, uint8_t *reply) {
+    int size = RDM_HEADER_SIZE + dataSize;
+    reply[0] = 0; // break
+    uint8_t *p = reply + 1;
+    p[0] = RDM_START_CODE;
+    p[1] = RDM_SUB_START_CODE;
+    p[2] = size;
+    memcpy(p + 3, request + 9, 6); // destination = source of the request
+    memcpy(p + 9, request + 3, 6);
+    p[15] = request[15]; // transaction number
+    p[16] = eRDMResponseType_ack;
+    p[17] = 0; // message count
+    p[18] = p[19] = 0; // sub-device
+    p[20] = request[20] + eRDMCommandClass_response;
+    p[21] = request[21];
+    p[22] = request[22];
+    p[23] = dataSize;
+    if (dataSize)
+      memcpy(p + RDM_HEADER_SIZE, data, dataSize);
+    uint16_t checksum = 0;
+    for (int i = 0; i < size; ++i)
+      checksum += p[i];
+    p[size] = checksum >> 8;
+    p[size + 1] = checksum;
+    return 1 + size + 2;
+  }
+
+  // encoded DISC_UNIQUE_BRANCH reply of a single responder
+  static int disc_reply(uint64_t uid, uint8_t *reply) {
+    int size = 0;
+    for (int i = 0; i < 7; ++i)
+      reply[size++] = 0xFE;
+    reply[size++] = 0xAA;
+    uint16_t checksum = 0;
+    for (int i = 5; i >= 0; --i) {
+      uint8_t b = uid >> (i * 8);
+      reply[size++] = b | 0xAA;
+      reply[size++] = b | 0x55;
+      checksum += (b | 0xAA) + (b | 0x55);
+    }
+    reply[size++] = (checksum >> 8) | 0xAA;
+    reply[size++] = (checksum >> 8) | 0x55;
+    reply[size++] = (checksum & 0xFF) | 0xAA;
+    reply[size++] = (checksum & 0xFF) | 0x55;
+    return size;
+  }
+
+protected:
+  virtual int Transact(const uint8_t *packet, int size, uint8_t *reply, int replySize, bool expectReply) {
+    ++this->transactions;
+    uint16_t checksum = 0;
+    for (int i = 0; i < size - 2; ++i)
+      checksum += packet[i];
+    if (((packet[size - 2] << 8) | packet[size - 1]) != checksum) {
+      printf("FAIL: request with a wrong checksum\n");
+      exit(1);
+    }
+    uint64_t destination = get_uid(packet + 3);
+    int commandClass = packet[20];
+    int pid = (packet[21] << 8) | packet[22];
+    if (pid == eRDMPID_discUnMute and destination == RDM_UID_BROADCAST) {
+      for (size_t i = 0; i < this->responders.size(); ++i)
+        this->responders[i].muted = false;
+      return 0;
+    }
+    if (pid == eRDMPID_discUniqueBranch) {
+      uint64_t lower = get_uid(packet + RDM_HEADER_SIZE);
+      uint64_t upper = get_uid(packet + RDM_HEADER_SIZE + 6);
+      int replyCount = 0;
+      for (size_t i = 0; i < this->responders.size(); ++i) {
+        const sResponder &r = this->responders[i];
+        if (r.muted or r.uid < lower or r.uid > upper)
+          continue;
+        uint8_t single[24];
+        int n = disc_reply(r.uid, single);
+        if (replyCount++ == 0) {
+          memcpy(reply, single, n);
+        } else {
+          for (int j = 0; j < n; ++j) // collision
+            reply[j] &= single[j];
+        }
+      }
+      return replyCount ? 24 : 0;
+    }
+    int replyBytes = 0; // responders with the same UID answer with the same bytes
+    for (size_t i = 0; i < this->responders.size(); ++i) {
+      sResponder &r = this->responders[i];
+      if (r.uid != destination)
+        continue;
+      if (pid == eRDMPID_discMute) {
+        if (!r.mutable_)
+          continue;
+        r.muted = true;
+        const uint8_t control[2] = {0, 0};
+        replyBytes = reply_packet(packet, control, sizeof(control), reply);
+      } else if (pid == eRDMPID_dmxStartAddress and commandClass == eRDMCommandClass_get) {
+        const uint8_t address[2] = {uint8_t(r.startAddress >> 8), uint8_t(r.startAddress)};
+        replyBytes = reply_packet(packet, address, sizeof(address), reply);
+      } else if (pid == eRDMPID_dmxStartAddress and commandClass == eRDMCommandClass_set) {
+        r.startAddress = (packet[RDM_HEADER_SIZE] << 8) | packet[RDM_HEADER_SIZE + 1];
+        replyBytes = reply_packet(packet, NULL, 0, reply);
+      }
+    }
+    if (replyBytes > replySize) {
+      printf("FAIL: reply buffer too small\n");
+      exit(1);
+    }
+    return expectReply ? replyBytes : 0;
+  }
+
+  virtual bool DeviceFound(uint64_t uid) {
+    if (!this->found.insert(uid).second) {
+      ++this->duplicates;
+      return false;
+    }
+    return true;
+  }
+
+public:
+  std::vector<sResponder> responders;
+  std::set<uint64_t> found;
+  int duplicates; // collisions, which looked like the reply of an already found device
+  int transactions;
+
+  RDMSimulator() : LoxRDMController(0x7FF0, 1), duplicates(0), transactions(0) {}
+
+  void Add(uint64_t uid, bool canMute = true) {
+    sResponder r = {uid, false, canMute, uint16_t(this->responders.size() + 1)};
+    this->responders.push_back(r);
+  }
+};
+
+static int failures = 0;
+
+/***
+ *  Run the discovery and check, that every mutable UID is found exactly once and no
+ *  unmutable UID is reported
+ ***/
+static void check_discovery(const char *name, RDMSimulator &sim) {
+  std::set<uint64_t> expected;
+  for (size_t i = 0; i < sim.responders.size(); ++i)
+    if (sim.responders[i].mutable_)
+      expected.insert(sim.responders[i].uid);
+  for (size_t i = 0; i < sim.responders.size(); ++i)
+    if (!sim.responders[i].mutable_)
+      expected.erase(sim.responders[i].uid);
+  int count = sim.Discover();
+  bool ok = (count == (int)expected.size()) and (sim.found == expected);
+  printf("%s %-32s responders=%4d found=%4d expected=%4d transactions=%d duplicates=%d\n", ok ? "ok  " : "FAIL", name,
+         (int)sim.responders.size(), count, (int)expected.size(), sim.transactions, sim.duplicates);
+  if (!ok)
+    ++failures;
+}
+
+static uint64_t random_uid(void) {
+  uint64_t uid = ((uint64_t)(rand() & 0xFFFF) << 32) | ((uint32_t)rand() * 2654435761u);
+  return uid > RDM_UID_MAX ? RDM_UID_MAX : uid;
+}
+
+int main(int argc, char **argv) {
+  int seeds = argc > 1 ? atoi(argv[1]) : 20;
+
+  for (int seed = 1; seed <= seeds; ++seed) {
+    static const int sizes[] = {1, 2, 10, 100, 512};
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); ++s) {
+      srand(seed);
+      RDMSimulator sim;
+      for (int i = 0; i < sizes[s]; ++i)
+        sim.Add((i % 10) == 0 ? (0x1234ull << 32) | i : random_uid()); // every 10th is from a dense block
+      char name[64];
+      snprintf(name, sizeof(name), "random seed=%d", seed);
+      check_discovery(name, sim);
+    }
+  }
+
+  { // neighbouring UIDs at both ends of the range, their replies collide into a valid looking reply
+    RDMSimulator sim;
+    sim.Add(0);
+    sim.Add(1);
+    sim.Add(RDM_UID_MAX - 1);
+    sim.Add(RDM_UID_MAX);
+    check_discovery("deepest branches", sim);
+  }
+
+  { // a long run of consecutive UIDs
+    RDMSimulator sim;
+    for (int i = 0; i < 256; ++i)
+      sim.Add(0x4C4F00000000ull + i);
+    check_discovery("consecutive UIDs", sim);
+  }
+
+  for (int seed = 1; seed <= seeds; ++seed) { // devices, which answer, but never acknowledge the mute
+    srand(seed);
+    RDMSimulator sim;
+    for (int i = 0; i < 50; ++i)
+      sim.Add(random_uid(), (i % 7) != 3);
+    sim.Add(0); // an unmutable UID 1 splits down to [0,1]: the deepest stack of the discovery
+    sim.Add(1, false);
+    char name[64];
+    snprintf(name, sizeof(name), "unmutable seed=%d", seed);
+    check_discovery(name, sim);
+  }
+
+  for (int seed = 1; seed <= seeds; ++seed) { // several devices with the same UID
+    srand(seed);
+    RDMSimulator sim;
+    for (int i = 0; i < 50; ++i) {
+      uint64_t uid = random_uid();
+      sim.Add(uid);
+      if ((i % 5) == 0)
+        sim.Add(uid);
+    }
+    char name[64];
+    snprintf(name, sizeof(name), "duplicate UIDs seed=%d", seed);
+    check_discovery(name, sim);
+  }
+
+  { // DMX start address
+    RDMSimulator sim;
+    sim.Add(0x123456789ull);
+    bool ok = sim.GetStartAddress(0x123456789ull) == 1 and sim.SetStartAddress(0x123456789ull, 77) and sim.GetStartAddress(0x123456789ull) == 77 and sim.GetStartAddress(0x42) < 0;
+    printf("%s %s\n", ok ? "ok  " : "FAIL", "start address");
+    if (!ok)
+      ++failures;
+  }
+
+  printf("%d failures\n", failures);
+  return failures ? 1 : 0;
+}